@@ -3,39 +3,71 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <avr/io.h>
-#include <util/delay.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
 
+#include "hal.h"
 #include "audio.h"
 #include "seq.h"
-#include "sintab.h"
-
-#define SINTAB_LEN 256
-#define NOTETAB_LEN 12
-#define NUM_OSCS 4
-
-/* F1 (43) .. G7 (1975) */
-
-#define SRATE (F_CPU / 512.0 / 2)
-#define F_NOTE0 43.653 	// Lowest note we can play is F1 at 43.653 Hz
-#define STEP_NOTE0 (F_NOTE0 * 256.0 * 256.0 / SRATE)
-
-
-uint16_t notetab[NOTETAB_LEN] = { 
-	1.0000 * STEP_NOTE0,
-	1.0594 * STEP_NOTE0,
-	1.1224 * STEP_NOTE0,
-	1.1892 * STEP_NOTE0,
-	1.2599 * STEP_NOTE0,
-	1.3348 * STEP_NOTE0,
-	1.4142 * STEP_NOTE0,
-	1.4983 * STEP_NOTE0,
-	1.5874 * STEP_NOTE0,
-	1.6817 * STEP_NOTE0,
-	1.7817 * STEP_NOTE0,
-	1.8877 * STEP_NOTE0,
+#include "tables.h"
+#include "fm.h"
+#include "sample.h"
+#include "pluck.h"
+#include "rhythm.h"
+
+#define NO_OSC 0xff
+
+#if NUM_OSCS >= 255
+#error "NUM_OSCS must be below 255"
+#endif
+
+/* Notes in the note to osc map. The keyboard reaches 32 keys two octaves
+ * either way from note 24, on the host tunes may use any note */
+
+#ifdef HOST
+#define MAP_NOTES NUM_NOTES
+#else
+#define MAP_NOTES 80
+#endif
+
+#define BLOCK_LEN 16		/* Samples per block rendered from the ISR */
+#define ADSR_PERIOD (SRATE * 176L / 15625)	/* Samples between ADSR updates, ~89 Hz */
+#define RAMP_MUL (65536L / ADSR_PERIOD)	/* Velocity unit per period to Q8.8 per sample */
+
+#if F_CPU / 8 / SRATE < 2 || F_CPU / 8 / SRATE > 256
+#error "SRATE is out of range of the timer 2 sample clock"
+#endif
+#if F_CPU % (8L * SRATE) != 0
+#error "SRATE must divide F_CPU / 8, the note table assumes the exact rate"
+#endif
+
+/* Voice stealing policies for when all oscillators are in use */
+
+#define STEAL_OLDEST 0		/* Longest playing note */
+#define STEAL_QUIETEST 1	/* Lowest ADSR velocity */
+#define STEAL_RELEASED 2	/* Quietest released note, else oldest */
+
+#ifndef VOICE_STEAL
+#define VOICE_STEAL STEAL_RELEASED
+#endif
+
+enum voice_type {
+	VOICE_FM,
+	VOICE_SAMPLE,
+	VOICE_PLUCK,
+};
+
+/*
+ * The ADSR state machine steps at the control rate, every ADSR_PERIOD
+ * samples, setting the velocity it ramps to. The level follows in a linear
+ * ramp, one Q8.8 increment per sample in the mix kernels, and reaches the
+ * velocity at the next control update
+ */
+
+enum adsr_state {
+	ADSR_ATTACK,
+	ADSR_DECAY,
+	ADSR_SUSTAIN,
+	ADSR_RELEASE,
+	ADSR_DONE,
 };
 
 struct adsr {
@@ -43,159 +75,460 @@ struct adsr {
 	uint8_t d;
 	uint8_t s;
 	uint8_t r;
-	uint8_t vel;
+	uint8_t vel;		/* Velocity at the end of the current ramp */
 	uint8_t state;
+	uint16_t level;		/* Current velocity, Q8.8 */
+	int16_t dlevel;		/* Ramp increment per sample, Q8.8 */
+};
+
+struct osc_op {
+	phase_t off;		/* Offset in sin table */
+	phase_t step;		/* Step size */
+	struct adsr adsr;	/* Velocity ADSR */
 };
 
 struct osc {
 	uint8_t note;		/* Note number */
 	uint16_t ticks;		/* Note clock ticks */
 
-	/* FM */
+	/* FM. The ADSR of operator 0 is the velocity of the voice, also for
+	 * sample playback */
+
+	uint8_t algo;		/* Operator algorithm */
+	uint8_t ops;		/* Operators in use */
+	uint8_t mod;		/* Modulation depth, as a shift */
+	int16_t fb;		/* Feedback state */
+	struct osc_op op[FM_OPS];
+#ifdef FM_CACHE
+	uint8_t mul;		/* Modulator frequency of a pair */
+	uint8_t baked;		/* Playing the baked waveform, op[0] runs at half speed */
+#endif
+
+	/* Sample playback and plucked strings */
+
+	uint8_t type;		/* Voice type */
+	union {
+		struct sample_voice smp;
+		struct pluck_voice pk;
+	};
+};
 
-	uint16_t off;		/* Osc offset in sin table */
-	uint16_t step;		/* Osc step size */
-	struct adsr adsr;	/* Velocity ADSR */
+/*
+ * Instrument template, copied into every osc the instrument plays. Sample
+ * and pluck voices fall back to the FM parameters when they cannot play
+ */
 
-	uint16_t moff;		/* Modulator osc offset in sin table */
-	uint16_t mstep;		/* Modulator osc step size */
-	struct adsr madsr;	/* Modulator ADSR */
+struct instr {
+	uint8_t type;		/* Voice type */
+	uint8_t sample;		/* Sample number, for sample voices */
+	uint8_t bridge;		/* Pluck position, for pluck voices */
+	uint8_t algo;		/* FM operator algorithm */
+	uint8_t fm_mul[FM_OPS - 1];	/* Frequencies of operators 1 and up, in half note frequencies */
+	uint8_t fm_mod;		/* Modulation depth, as a shift */
+	struct adsr adsr[FM_OPS];	/* ADSR of each operator */
+};
+
+#define ADSR(a, d, s, r) { a, d, s, r, 0, ADSR_ATTACK, 0, 0 }
+
+static const struct instr instrs[NUM_INSTRS] PROGMEM = {
+	[INSTR_CLARINET] = {
+		.type = VOICE_SAMPLE, .sample = 0, .fm_mul = { 2 }, .fm_mod = 4,
+		.adsr = { ADSR(127, 0, 127, 20), ADSR(64, 2, 5, 5) },
+	},
+	[INSTR_ELECTRIC_GUITAR] = {
+		.type = VOICE_SAMPLE, .sample = 1, .fm_mul = { 2 }, .fm_mod = 4,
+		.adsr = { ADSR(127, 1, 60, 10), ADSR(64, 2, 5, 5) },
+	},
+	[INSTR_OBOE] = {
+		.type = VOICE_SAMPLE, .sample = 2, .fm_mul = { 2 }, .fm_mod = 4,
+		.adsr = { ADSR(40, 0, 127, 20), ADSR(64, 2, 5, 5) },
+	},
+	[INSTR_VIOLIN] = {
+		.type = VOICE_SAMPLE, .sample = 3, .fm_mul = { 2 }, .fm_mod = 4,
+		.adsr = { ADSR(16, 0, 127, 8), ADSR(64, 2, 5, 5) },
+	},
+	[INSTR_XYLOPHONE] = {
+		.type = VOICE_SAMPLE, .sample = 4, .fm_mul = { 2 }, .fm_mod = 4,
+		.adsr = { ADSR(127, 0, 127, 30), ADSR(64, 2, 5, 5) },
+	},
+#if FM_OPS == 4
+	[INSTR_PIANO] = {
+		.type = VOICE_FM, .algo = FM_ALGO_PAIR, .fm_mul = { 4, 2, 8 }, .fm_mod = 4,
+		.adsr = { ADSR(64, 5, 50, 20), ADSR(64, 2, 5, 5), ADSR(64, 3, 10, 5), ADSR(64, 4, 0, 5) },
+	},
+	[INSTR_BANJO] = {
+		.type = VOICE_PLUCK, .bridge = 3,
+		.algo = FM_ALGO_STACK3, .fm_mul = { 6, 2 }, .fm_mod = 3,
+		.adsr = { ADSR(127, 2, 0, 30), ADSR(127, 10, 0, 10), ADSR(127, 24, 0, 10) },
+	},
+#else
+	[INSTR_PIANO] = {
+		.type = VOICE_FM, .algo = FM_ALGO_PAIR, .fm_mul = { 4 }, .fm_mod = 4,
+		.adsr = { ADSR(64, 5, 50, 20), ADSR(64, 2, 5, 5) },
+	},
+	[INSTR_BANJO] = {
+		.type = VOICE_PLUCK, .bridge = 3,
+		.algo = FM_ALGO_PAIR, .fm_mul = { 6 }, .fm_mod = 3,
+		.adsr = { ADSR(127, 2, 0, 30), ADSR(127, 10, 0, 10) },
+	},
+#endif
+	[INSTR_HARPISCORD] = {
+		.type = VOICE_PLUCK, .bridge = 2, .fm_mul = { 2 }, .fm_mod = 4,
+		.adsr = { ADSR(127, 0, 127, 25), ADSR(64, 2, 5, 5) },
+	},
+};
 
-	/* Wave table */
 
-	uint32_t woff;
-	uint16_t wstep;
-	uint32_t loop_end;
-	uint32_t loop_rev;
-	uint8_t wvel;
-	void *sample;
+/*
+ * Commands from the main loop to the audio context. The oscs and the current
+ * instrument belong to render_block(), which applies the queued commands
+ * before every block and sub-block, so they are only ever touched from one
+ * context and need no locking or volatile. The main loop is the only writer
+ * of cmd_head and the audio context the only writer of cmd_tail, which makes
+ * the ring safe without disabling interrupts, and without locks between
+ * threads on the host
+ */
+
+/* Queued commands, a power of two. The ring drains at every block, about
+ * a millisecond on the AVR, which is more than the keyboard can fill */
+
+#ifdef HOST
+#define CMD_RING 16
+#else
+#define CMD_RING 8
+#endif
+
+enum cmd_op {
+	CMD_NOTE_ON,
+	CMD_NOTE_OFF,
+	CMD_ALL_OFF,
+	CMD_INSTR,
+	CMD_FM,			/* Ratio in the high nibble, depth in the low one */
+	CMD_ALGO,
 };
 
+struct cmd {
+	uint8_t op;
+	uint8_t arg;
+};
+
+static struct cmd cmd_ring[CMD_RING];
+static uint8_t cmd_head;		/* Next free slot, written by the main loop */
+static uint8_t cmd_tail;		/* Next command, written by the audio context */
+static uint8_t ctl_mul, ctl_mod;	/* FM parameters as last set, for osc_get_fm() */
 
 static volatile uint8_t master_vol = 0;
-static volatile struct osc oscs[NUM_OSCS];
-static volatile uint16_t bip_off = 0;
+static struct osc oscs[NUM_OSCS];
+static phase_t bip_off = 0;
 static volatile uint16_t bip_t = 0;
-static volatile uint8_t fm_mul;
-static volatile uint8_t fm_mod;
+static struct instr instr;		/* Current instrument */
+static int16_t buf[2 * BLOCK_LEN];
+static uint8_t osc_list[NUM_OSCS];	/* Active oscs first, then free ones */
+static uint8_t active_count;
+static uint8_t note_osc[MAP_NOTES];	/* Osc playing each note, or NO_OSC */
 
-void audio_init(void)
+
+static void free_all(void)
 {
-	/* Timer 0: ticks timer at 1 Khz */
+	uint8_t i;
 
-	TCCR0A = 0;
-	TCCR0B = (1<<CS01) | (1<<CS00);
-	TIMSK0 |= (1<<TOIE0);
+	for(i=0; i<NUM_OSCS; i++) {
+		oscs[i].note = 0;
+		osc_list[i] = i;
+		pluck_free(i);
+#ifdef FM_CACHE
+		oscs[i].baked = 0;
+		fm_bake_free(i);
+#endif
+	}
+	active_count = 0;
+	memset(note_osc, NO_OSC, sizeof note_osc);
+}
 
-	/* Timer 1: Fast PWM 10 bit */
+
+void audio_init(void)
+{
+	fm_init();
+	free_all();
+	set_instr(INSTR_PIANO);
+
+	/* Timer 1: Fast PWM 9 bit at 31.25 Khz, no interrupts. OCR1A is
+	 * double buffered and may be written at any time */
 
 	TCCR1A = (1<<COM1A1) | (1<<WGM11) | (0<<WGM10);
 	TCCR1B = (1<<CS10) | (1<<WGM12);
 	DDRD |= (1<<PD5);
-	TIMSK1 |= (1<<TOIE1);
+
+	/* Timer 2: sample clock, CTC at clk/8/(OCR2A+1) = SRATE */
+
+	TCCR2A = (1<<WGM21);
+	TCCR2B = (1<<CS21);
+	OCR2A = F_CPU / 8 / SRATE - 1;
+	TIMSK2 |= (1<<OCIE2A);
+}
+
+
+/*
+ * Queue a command for the audio context. When the ring is full, wait for the
+ * renderer to take one
+ */
+
+static void send_cmd(uint8_t op, uint8_t arg)
+{
+	uint8_t head = cmd_head;
+	uint8_t next = (head + 1) & (CMD_RING - 1);
+
+	while(next == load_acquire(&cmd_tail));
+
+	cmd_ring[head].op = op;
+	cmd_ring[head].arg = arg;
+	store_release(&cmd_head, next);
 }
 
 
+/*
+ * Set the FM parameters of the current instrument, for new notes
+ */
+
 void osc_set_fm(uint8_t mul, uint8_t mod)
 {
-	fm_mul = mul;
-	fm_mod = 7 - mod;
+	ctl_mul = mul;
+	ctl_mod = mod;
+	send_cmd(CMD_FM, (mul << 4) | mod);
 }
 
 
-void note_on(uint8_t note)
+void osc_get_fm(uint8_t *mul, uint8_t *mod)
 {
-	volatile struct osc *osc;
-	uint8_t i;
+	*mul = ctl_mul;
+	*mod = ctl_mod;
+}
 
-	/* Find free osc, or just pick one */
 
-	for(i=0; i<NUM_OSCS; i++) {
-		osc = &oscs[i];
-		if(osc->note == 0) break;
-	}
+/*
+ * Set the FM operator algorithm of the current instrument, for new notes
+ */
 
+void osc_set_algo(uint8_t algo)
+{
+	if(algo < NUM_FM_ALGOS) send_cmd(CMD_ALGO, algo);
+}
 
-	osc->note = note;
-	osc->ticks = 0;
 
-	/* FM */
-	
-	osc->step = notetab[note % 12] << (note / 12);
-	osc->mstep = osc->step * fm_mul / 2;
-
-	osc->adsr.a = 64;
-	osc->adsr.d = 5;
-	osc->adsr.s = 50;
-	osc->adsr.r = 20;
-	osc->adsr.vel = 0;
-	osc->adsr.state = 0;
-
-	osc->madsr.a = 64;
-	osc->madsr.d = 2;
-	osc->madsr.s = 5;
-	osc->madsr.r = 5;
-	osc->madsr.vel = 0;
-	osc->madsr.state = 0;
+/*
+ * Select the instrument for new notes
+ */
+
+void set_instr(uint8_t i)
+{
+	if(i >= NUM_INSTRS) return;
+
+	ctl_mul = pgm_read_byte(&instrs[i].fm_mul[0]);
+	ctl_mod = 7 - pgm_read_byte(&instrs[i].fm_mod);
+	send_cmd(CMD_INSTR, i);
+}
+
+
+void note_on(uint8_t note)
+{
+	send_cmd(CMD_NOTE_ON, note);
 }
 
 
 void note_off(uint8_t note)
 {
-	volatile struct osc *osc;
+	send_cmd(CMD_NOTE_OFF, note);
+}
+
+
+void all_off(void)
+{
+	send_cmd(CMD_ALL_OFF, 0);
+}
+
+
+/*
+ * Pick the oscillator to take over when none are free
+ */
+
+static uint8_t steal_osc(void)
+{
+	struct osc *osc;
 	uint8_t i;
+	uint8_t best = 0;
+	uint16_t score;
+	uint16_t best_score = 0;
 
 	for(i=0; i<NUM_OSCS; i++) {
 		osc = &oscs[i];
-		if(osc->note == note) {
-			osc->adsr.state = 3;
-			osc->wvel = 126;
+#if VOICE_STEAL == STEAL_OLDEST
+		score = osc->ticks;
+#elif VOICE_STEAL == STEAL_QUIETEST
+		score = 127 - osc->op[0].adsr.vel;
+#else
+		if(osc->op[0].adsr.state >= ADSR_RELEASE) {
+			score = 0x8000 + 127 - osc->op[0].adsr.vel;
+		} else {
+			score = osc->ticks < 0x7fff ? osc->ticks : 0x7fff;
+		}
+#endif
+		if(score >= best_score) {
+			best_score = score;
+			best = i;
 		}
 	}
+
+	return best;
 }
 
 
-void all_off(void)
+/*
+ * Start a note, from the audio context
+ */
+
+void voice_on(uint8_t note)
 {
-	uint8_t i;
-	for(i=0; i<NUM_OSCS; i++) {
-		oscs[i].note = 0;
+	struct osc *osc;
+	phase_t step;
+	uint8_t i, k;
+
+	/* Retrigger the osc already playing this note, or take a free
+	 * osc, or steal one */
+
+	note &= NUM_NOTES - 1;
+	if(note >= MAP_NOTES) return;
+	i = note_osc[note];
+
+	if(i == NO_OSC) {
+		if(active_count < NUM_OSCS) {
+			i = osc_list[active_count++];
+		} else {
+			i = steal_osc();
+			note_osc[oscs[i].note] = NO_OSC;
+		}
+		note_osc[note] = i;
+	}
+
+	osc = &oscs[i];
+	osc->note = note;
+	osc->ticks = 0;
+
+	/* Start from the instrument template */
+
+	osc->type = instr.type;
+	osc->algo = instr.algo;
+	osc->ops = fm_algo_ops(instr.algo);
+	osc->mod = instr.fm_mod;
+	osc->fb = 0;
+
+	step = pgm_read_dword(&notetab[note]);
+	pluck_free(i);
+
+	if(osc->type == VOICE_SAMPLE) {
+		if(sample_start(&osc->smp, instr.sample, note)) {
+			osc->ops = 1;
+		} else {
+			osc->type = VOICE_FM;
+		}
+	}
+
+	if(osc->type == VOICE_PLUCK) {
+		if(pluck_start(&osc->pk, i, step, instr.bridge)) {
+			osc->ops = 1;
+		} else {
+			osc->type = VOICE_FM;
+		}
+	}
+
+	osc->op[0].step = step;
+	osc->op[0].adsr = instr.adsr[0];
+	for(k=1; k<osc->ops; k++) {
+		osc->op[k].step = step * instr.fm_mul[k - 1] / 2;
+		osc->op[k].adsr = instr.adsr[k];
+	}
+
+#ifdef FM_CACHE
+	/* Line the modulator up with the carrier, so the voice plays
+	 * the waveform of the cache once it sustains */
+
+	if(osc->baked) osc->op[0].off <<= 1;
+	osc->baked = 0;
+	osc->mul = instr.fm_mul[0];
+	osc->op[1].off = fm_mod_phase(osc->op[0].off, osc->mul);
+	fm_bake_free(i);
+#endif
+
+	/* A plucked string starts at full level, its ADSR only shapes
+	 * the decay and release */
+
+	if(osc->type == VOICE_PLUCK) {
+		osc->op[0].adsr.vel = 127;
+		osc->op[0].adsr.level = 127 << 8;
+		osc->op[0].adsr.state = ADSR_DECAY;
 	}
 }
 
 
-static void update_adsr(volatile struct adsr *adsr)
+/*
+ * Release a note, from the audio context
+ */
+
+void voice_off(uint8_t note)
 {
-	int16_t vel = adsr->vel;
+	uint8_t i;
+
+	note &= NUM_NOTES - 1;
+	if(note >= MAP_NOTES) return;
+	i = note_osc[note];
+	if(i != NO_OSC) oscs[i].op[0].adsr.state = ADSR_RELEASE;
+}
+
+
+static void update_adsr(struct adsr *adsr)
+{
+	uint8_t from = adsr->vel;
+	int16_t vel = from;
+
+	/* The previous ramp ends exactly on its target. Sustain and done hold
+	 * their level and cost nothing more */
+
+	adsr->level = from << 8;
+	adsr->dlevel = 0;
 
 	switch(adsr->state) {
-		case 0:
+		case ADSR_ATTACK:
 			vel = vel + adsr->a;
 			if(vel >= 127) {
 				vel = 127;
-				adsr->state = 1;
+				adsr->state = ADSR_DECAY;
 			}
 			break;
-		case 1:
+		case ADSR_DECAY:
 			vel = vel - adsr->d;
 			if(vel <= adsr->s) {
 				vel = adsr->s;
-				adsr->state = 2;
+				adsr->state = ADSR_SUSTAIN;
 			}
 			break;
-		case 2:
-			break;
-		case 3:
+		case ADSR_RELEASE:
 			vel = vel - adsr->r;
 			if(vel <= 0) {
 				vel = 0;
-				adsr->state = 4;
+				adsr->state = ADSR_DONE;
 			}
 			break;
-		case 4:
-			break;
+		default:
+			return;
 	}
 
+	/* Rounded towards the start of the ramp, so the level never
+	 * overshoots its target */
+
+	if(vel >= from) {
+		adsr->dlevel = ((uint32_t)(vel - from) * RAMP_MUL) >> 8;
+	} else {
+		adsr->dlevel = -(int16_t)(((uint32_t)(from - vel) * RAMP_MUL) >> 8);
+	}
 	adsr->vel = vel;
 }
 
@@ -214,82 +547,270 @@ void master_vol_set(uint8_t vol)
 
 
 /*
- * Oscillator / ADSR update timer
+ * Control rate update of all oscillators, called every ADSR_PERIOD samples
  */
 
-ISR(TIMER0_OVF_vect) __attribute__((interrupt));
-ISR(TIMER0_OVF_vect)
+static void update_oscs(void)
 {
-	uint8_t i;
-	static uint8_t t = 0;
-	volatile struct osc *osc;
+	uint8_t i, j, k;
+	struct osc *osc;
 
-	if(t++ == 10) {
-		t = 0;
+	/* Walk backwards, finished oscs are swapped with the last active one */
 
-		PORTB |=  2;
-		for(i=0; i<NUM_OSCS; i++) {
-			osc = &oscs[i];
+	for(k=active_count; k-- > 0; ) {
+		i = osc_list[k];
+		osc = &oscs[i];
+
+		/* Released oscs are done once the ramp down to zero has played */
+
+		if(osc->op[0].adsr.state == ADSR_DONE) {
+			pluck_free(i);
+#ifdef FM_CACHE
+			if(osc->baked) osc->op[0].off <<= 1;
+			osc->baked = 0;
+			fm_bake_free(i);
+#endif
+			note_osc[osc->note] = NO_OSC;
+			osc->note = 0;
+			active_count --;
+			osc_list[k] = osc_list[active_count];
+			osc_list[active_count] = i;
+			continue;
+		}
 
-			update_adsr(&osc->adsr);
-			update_adsr(&osc->madsr);
-			osc->ticks ++;
-			if(osc->adsr.state == 4) osc->note = 0;
+		for(j=0; j<osc->ops; j++) update_adsr(&osc->op[j].adsr);
+		if(osc->ticks != 0xffff) osc->ticks ++;
+
+#ifdef FM_CACHE
+		/* A pair whose modulator holds its sustain level no longer
+		 * changes its waveform */
+
+		if(osc->type == VOICE_FM && osc->algo == FM_ALGO_PAIR && !osc->baked &&
+				osc->op[1].adsr.state == ADSR_SUSTAIN && osc->op[1].adsr.dlevel == 0 &&
+				fm_bake(i, osc->mul, osc->mod, osc->op[1].adsr.vel)) {
+			osc->op[0].off = fm_bake_phase(osc->op[0].off, osc->op[1].off, osc->mul);
+			osc->op[0].step >>= 1;
+			osc->baked = 1;
 		}
-		PORTB &= ~2;
+#endif
 	}
 }
 
 
-
 /*
- * Audio timer, highest prio. Mixes active oscillators and sets PWM output to D/A
- * converter value
+ * Mix all active oscillators into out[]. The oscillator state is copied into
+ * a struct fm_voice, fm_ops, sample_voice or pluck_voice so the kernel runs
+ * from registers. Only the oscs in the active part of osc_list are visited,
+ * silence costs no more than clearing the buffer
  */
 
-ISR(TIMER1_OVF_vect)
+static void mix(int16_t *out, uint16_t n)
 {
-	int16_t c = 0;
-	volatile struct osc *osc;
-	uint8_t i;
-	static uint8_t t = 0;
-	uint8_t off;
-
-	if(t++ != 1) return;
-	t = 0;
+	struct osc *osc;
+	uint8_t i, k;
+	uint16_t j;
+	uint8_t vol = master_vol;
+	uint8_t count = active_count;
+	uint8_t drums;
+
+	for(j=0; j<n; j++) out[j] = 0;
+	drums = rhythm_mix(out, n);
+	if(count == 0 && bip_t == 0 && !drums) return;
+
+	for(k=0; k<count; k++) {
+		osc = &oscs[osc_list[k]];
+
+		if(osc->type == VOICE_SAMPLE) {
+			struct sample_voice w = osc->smp;
+			w.vel = osc->op[0].adsr.level;
+			w.dvel = osc->op[0].adsr.dlevel;
+			if(!sample_mix(out, n, &w)) osc->op[0].adsr.state = ADSR_DONE;
+			osc->smp.off = w.off;
+			osc->smp.rev = w.rev;
+			osc->op[0].adsr.level = w.vel;
+			continue;
+		}
 
-	/* Mix all notes and create audio */
+		if(osc->type == VOICE_PLUCK) {
+			struct pluck_voice w = osc->pk;
+			w.vel = osc->op[0].adsr.level;
+			w.dvel = osc->op[0].adsr.dlevel;
+			pluck_mix(out, n, &w);
+			osc->pk.pos = w.pos;
+			osc->op[0].adsr.level = w.vel;
+			continue;
+		}
 
-	PORTB |= 1;
+		if(osc->algo != FM_ALGO_PAIR) {
+			struct fm_ops w;
+			for(i=0; i<osc->ops; i++) {
+				w.op[i].off = osc->op[i].off;
+				w.op[i].step = osc->op[i].step;
+				w.op[i].vel = osc->op[i].adsr.level;
+				w.op[i].dvel = osc->op[i].adsr.dlevel;
+			}
+			w.fb = osc->fb;
+			fm_mix_algo(osc->algo, out, n, &w, osc->mod);
+			for(i=0; i<osc->ops; i++) {
+				osc->op[i].off = w.op[i].off;
+				osc->op[i].adsr.level = w.op[i].vel;
+			}
+			osc->fb = w.fb;
+			continue;
+		}
 
-	for(i=0; i<NUM_OSCS; i++) {
-		osc = &oscs[i];
-		if(! osc->note) continue;
+		struct fm_voice v = {
+			.off = osc->op[0].off,
+			.step = osc->op[0].step,
+			.moff = osc->op[1].off,
+			.mstep = osc->op[1].step,
+			.vel = osc->op[0].adsr.level,
+			.dvel = osc->op[0].adsr.dlevel,
+			.mvel = osc->op[1].adsr.level,
+			.dmvel = osc->op[1].adsr.dlevel,
+		};
+
+#ifdef FM_CACHE
+		if(osc->baked) {
+			fm_mix_baked(out, n, &v, osc_list[k]);
+			osc->op[0].off = v.off;
+			osc->op[0].adsr.level = v.vel;
+			continue;
+		}
+#endif
 
-		int16_t m;
+		fm_mix(out, n, &v, osc->mod);
 
-		m = sintab[osc->moff >> 8];
-		m = m * osc->madsr.vel / 16;
-		m >>= fm_mod;
-		off = (osc->off >> 8) + m;
-		if(osc->note) c = c + osc->adsr.vel * sintab[off] / (64 * NUM_OSCS); 
-		osc->off += osc->step;
-		osc->moff += osc->mstep;
+		osc->op[0].off = v.off;
+		osc->op[1].off = v.moff;
+		osc->op[0].adsr.level = v.vel;
+		osc->op[1].adsr.level = v.mvel;
 	}
 
-	if(bip_t) {
-		c = c + sintab[bip_off >> 8] / 8;
-		bip_off += 10000;
+	for(j=0; j<n && bip_t; j++) {
+		out[j] += sin_get(bip_off >> SIN_SHIFT) / (8 << SIN_SCALE);
+		bip_off += (phase_t)10000 << (PHASE_BITS - 16);
 		bip_t --;
 	}
 
-	c >>= master_vol;
-	c += 256;
-	OCR1A = c;
+	/* The drums and the bip come on top of a full mix of the oscs; clip
+	 * to the 9 bit PWM range so a peak does not wrap around */
+
+	for(j=0; j<n; j++) {
+		int16_t v = out[j] >> vol;
+		out[j] = v < -256 ? -256 : v > 255 ? 255 : v;
+	}
+}
+
+
+/*
+ * Apply the commands queued by the main loop
+ */
+
+static void run_cmds(void)
+{
+	uint8_t tail = cmd_tail;
+	uint8_t head = load_acquire(&cmd_head);
+
+	while(tail != head) {
+		struct cmd *c = &cmd_ring[tail];
+
+		switch(c->op) {
+			case CMD_NOTE_ON:
+				voice_on(c->arg);
+				break;
+			case CMD_NOTE_OFF:
+				voice_off(c->arg);
+				break;
+			case CMD_ALL_OFF:
+				free_all();
+				break;
+			case CMD_INSTR:
+				memcpy_P(&instr, &instrs[c->arg], sizeof instr);
+				break;
+			case CMD_FM:
+				instr.fm_mul[0] = c->arg >> 4;
+				instr.fm_mod = 7 - (c->arg & 0x0f);
+				break;
+			case CMD_ALGO:
+				instr.algo = c->arg;
+				break;
+		}
+
+		tail = (tail + 1) & (CMD_RING - 1);
+	}
+
+	store_release(&cmd_tail, tail);
+}
+
+
+/*
+ * Render n samples of audio. The block is split at the points where a
+ * sequencer tick with work to do or the ADSR update is due, so control
+ * events land on the same sample regardless of the block size. Queued
+ * commands are applied before each part; rendering 0 samples only applies
+ * them
+ */
+
+void render_block(int16_t *out, size_t n)
+{
+	static uint16_t seq_wait = 1;
+	static uint16_t adsr_wait = ADSR_PERIOD;
+
+	run_cmds();
+
+	while(n) {
+		uint16_t len;
+
+		if(seq_changed) seq_wait = seq_resync(seq_wait);
+
+		len = adsr_wait;
+		if(len > seq_wait) len = seq_wait;
+		if(len > n) len = n;
+
+		mix(out, len);
+		out += len;
+		n -= len;
+
+		seq_wait -= len;
+		adsr_wait -= len;
+
+		if(seq_wait == 0) seq_wait = seq_tick();
+
+		if(adsr_wait == 0) {
+			update_oscs();
+			adsr_wait = ADSR_PERIOD;
+		}
+
+		run_cmds();
+	}
+}
+
 
-	seq_tick();
-	
-	PORTB &= ~1;
+/*
+ * Sample timer. Sends the next sample to the PWM output which is connected
+ * to the D/A converter. When half of the buffer is drained, the next block is
+ * rendered into it with interrupts enabled so the output keeps running
+ * meanwhile
+ */
+
+ISR(TIMER2_COMPA_vect)
+{
+	static uint8_t pos = 0;
+	static uint8_t busy = 0;
+
+	OCR1A = buf[pos] + 256;
+	pos = (pos + 1) % (2 * BLOCK_LEN);
+
+	if((pos % BLOCK_LEN) == 0 && !busy) {
+		busy = 1;
+		sei();
+		PORTB |= 1;
+		render_block(buf + BLOCK_LEN - pos, BLOCK_LEN);
+		PORTB &= ~1;
+		cli();
+		busy = 0;
+	}
 }
 
 
@@ -299,3 +820,4 @@ ISR(TIMER1_OVF_vect)
  */
 
 
+
@@ -1,14 +1,65 @@
 #ifndef audio_h
 #define audio_h
 
+#ifndef NUM_OSCS
+#define NUM_OSCS 4
+#endif
+
+#ifndef SRATE
+#define SRATE 15625		/* Sample rate, F_CPU / 8 / SRATE must fit timer 2 */
+#endif
+
+/*
+ * Scale the magnitude p of a voice sample, an 8 bit value times an 8 bit
+ * velocity, to the mix: p / (64 * NUM_OSCS). With a power of two number of
+ * oscs that is a shift, otherwise the shift by 64 leaves a value below 512
+ * which is divided by NUM_OSCS through a 17 bit reciprocal; the rounding
+ * error of the reciprocal times 512 stays below 1 << 17, so the quotient is
+ * exact and the AVR needs no division
+ */
+
+#if (NUM_OSCS & (NUM_OSCS - 1)) == 0
+#define MIX_SCALE(p) ((uint16_t)(p) / (64 * NUM_OSCS))
+#else
+#define MIX_RECIP (((1UL << 17) + NUM_OSCS - 1) / NUM_OSCS)
+#define MIX_SCALE(p) ((uint16_t)((uint16_t)(p) >> 6) * (uint32_t)MIX_RECIP >> 17)
+#endif
+
+/* Instruments, in the order of the instrument keys */
+
+enum instr_num {
+	INSTR_CLARINET,
+	INSTR_ELECTRIC_GUITAR,
+	INSTR_OBOE,
+	INSTR_VIOLIN,
+	INSTR_XYLOPHONE,
+	INSTR_PIANO,
+	INSTR_BANJO,
+	INSTR_HARPISCORD,
+	NUM_INSTRS
+};
+
+/*
+ * The main loop controls the audio context through a command ring:
+ * set_instr(), osc_set_fm(), osc_set_algo(), note_on(), note_off() and
+ * all_off() only queue their command, render_block() applies it. Code
+ * running inside render_block(), like the sequencer tick, starts and
+ * releases notes directly with voice_on() and voice_off()
+ */
+
 void audio_init(void);
 void set_instr(uint8_t instr);
-void osc_set_fm(uint8_t mul, uint8_t vel);
+void osc_set_fm(uint8_t mul, uint8_t mod);
+void osc_get_fm(uint8_t *mul, uint8_t *mod);
+void osc_set_algo(uint8_t algo);
 void note_on(uint8_t note);
 void note_off(uint8_t note);
 void all_off(void);
+void voice_on(uint8_t note);
+void voice_off(uint8_t note);
 void bip(uint8_t duration);
 void metronome_set(uint8_t tempo);
 void master_vol_set(uint8_t vol);
+void render_block(int16_t *out, size_t n);
 
 #endif
@@ -0,0 +1,492 @@
+
+/*
+ * FM voice mixing kernels. The plain C kernel is the reference; the AVR uses
+ * the equivalent multiply and shift kernel, and on the host the fastest
+ * kernel supported by the CPU is selected at run time. The multi operator
+ * algorithms have one plain C kernel each.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hal.h"
+#include "audio.h"
+#include "tables.h"
+#include "fm.h"
+
+#define MIX_DIV (64 * NUM_OSCS)
+
+/*
+ * The kernels are written for the 256 entry, 8 bit sine table. Wider table
+ * values are scaled down by SIN_SCALE and need 32 bit products; modulation
+ * depths are in 256 entry table units and are scaled to the table length
+ */
+
+#if SINTAB_BITS > 8
+typedef int32_t acc_t;
+typedef uint32_t uacc_t;
+#else
+typedef int16_t acc_t;
+typedef uint16_t uacc_t;
+#endif
+
+#if SINTAB_ORDER >= 8
+#define MOD_INDEX(m) ((m) * (1 << (SINTAB_ORDER - 8)))
+#else
+#define MOD_INDEX(m) ((m) >> (8 - SINTAB_ORDER))
+#endif
+
+
+void fm_mix_c(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod)
+{
+	phase_t off = v->off;
+	phase_t step = v->step;
+	phase_t moff = v->moff;
+	phase_t mstep = v->mstep;
+	uint16_t vel = v->vel;
+	int16_t dvel = v->dvel;
+	uint16_t mvel = v->mvel;
+	int16_t dmvel = v->dmvel;
+	uint16_t j;
+
+	for(j=0; j<n; j++) {
+		acc_t m;
+		sin_idx_t o;
+
+		m = sin_get(moff >> SIN_SHIFT);
+		m = m * (uint8_t)(mvel >> 8) / 16;
+		m >>= mod + SIN_SCALE;
+		o = (off >> SIN_SHIFT) + MOD_INDEX(m);
+		out[j] += (acc_t)(uint8_t)(vel >> 8) * sin_get(o) / ((acc_t)MIX_DIV << SIN_SCALE);
+		off += step;
+		moff += mstep;
+		vel += dvel;
+		mvel += dmvel;
+	}
+
+	v->off = off;
+	v->moff = moff;
+	v->vel = vel;
+	v->mvel = mvel;
+}
+
+
+/*
+ * Bit exact with fm_mix_c(), shaped for the AVR. The sine table is
+ * antisymmetric with a non-negative first half, so both products are done as
+ * 8x8 unsigned multiplies on the magnitude of the table value, and the signed
+ * divisions, which truncate towards zero, become unsigned shifts of the
+ * magnitude with the sign applied afterwards. With NUM_OSCS a power of two
+ * there are no divisions left at all, and for 4 oscs the mix divisor is just
+ * the high byte of the product
+ */
+
+void fm_mix_mul(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod)
+{
+	phase_t off = v->off;
+	phase_t step = v->step;
+	phase_t moff = v->moff;
+	phase_t mstep = v->mstep;
+	uint16_t vel = v->vel;
+	int16_t dvel = v->dvel;
+	uint16_t mvel = v->mvel;
+	int16_t dmvel = v->dmvel;
+	uint16_t j;
+
+	for(j=0; j<n; j++) {
+		sin_idx_t i, o;
+		uacc_t p;
+		acc_t m;
+
+		i = moff >> SIN_SHIFT;
+		p = (uacc_t)sin_mag(i) * (uint8_t)(mvel >> 8);
+		m = p >> 4;
+		if(i & (SINTAB_LEN/2)) m = -m;
+		m >>= mod + SIN_SCALE;
+
+		o = ((off >> SIN_SHIFT) + MOD_INDEX(m)) & (SINTAB_LEN - 1);
+		p = (uacc_t)sin_mag(o) * (uint8_t)(vel >> 8);
+		p = MIX_SCALE(p >> SIN_SCALE);
+		if(o & (SINTAB_LEN/2)) {
+			out[j] -= p;
+		} else {
+			out[j] += p;
+		}
+
+		off += step;
+		moff += mstep;
+		vel += dvel;
+		mvel += dmvel;
+	}
+
+	v->off = off;
+	v->moff = moff;
+	v->vel = vel;
+	v->mvel = mvel;
+}
+
+
+/*
+ * Modulator output of operator o, as an offset to the table index of the
+ * operator it modulates, and carrier output of o, as in fm_mix_c(). The
+ * input in is the sum of the outputs of the modulators of o
+ */
+
+static inline acc_t op_mod(struct fm_op *o, acc_t in, uint8_t mod)
+{
+	sin_idx_t i = (o->off >> SIN_SHIFT) + MOD_INDEX(in);
+	acc_t m = sin_get(i);
+
+	m = m * (uint8_t)(o->vel >> 8) / 16;
+	return m >> (mod + SIN_SCALE);
+}
+
+
+static inline acc_t op_out(struct fm_op *o, acc_t in, uint8_t carriers)
+{
+	sin_idx_t i = (o->off >> SIN_SHIFT) + MOD_INDEX(in);
+
+	return (acc_t)(uint8_t)(o->vel >> 8) * sin_get(i) / ((acc_t)MIX_DIV * carriers << SIN_SCALE);
+}
+
+
+/*
+ * Generic multi operator kernel. It is always inlined with a constant algo,
+ * so the switch and the loops over the operators fold away at compile time
+ * and each algorithm gets its own loop which only computes and advances the
+ * operators it uses. Feedback is smoothed over two samples to keep it from
+ * breaking into noise
+ */
+
+static inline __attribute__((always_inline))
+void fm_algo_run(const uint8_t algo, int16_t *out, uint16_t n, struct fm_ops *v, uint8_t mod)
+{
+	struct fm_op o[FM_OPS];
+	acc_t fb = v->fb;
+	uint16_t j;
+	uint8_t k;
+
+	for(k=0; k<fm_algo_ops(algo); k++) o[k] = v->op[k];
+
+	for(j=0; j<n; j++) {
+		acc_t m;
+
+		switch(algo) {
+			case FM_ALGO_FEEDBACK:
+				m = op_mod(&o[1], fb, mod);
+				fb = (fb + m) >> 1;
+				out[j] += op_out(&o[0], m, 1);
+				break;
+#if FM_OPS == 4
+			case FM_ALGO_STACK3:
+				m = op_mod(&o[2], 0, mod);
+				m = op_mod(&o[1], m, mod);
+				out[j] += op_out(&o[0], m, 1);
+				break;
+			case FM_ALGO_BRANCH:
+				m = op_mod(&o[1], 0, mod) + op_mod(&o[2], 0, mod);
+				out[j] += op_out(&o[0], m, 1);
+				break;
+			case FM_ALGO_STACK4:
+				m = op_mod(&o[3], 0, mod);
+				m = op_mod(&o[2], m, mod);
+				m = op_mod(&o[1], m, mod);
+				out[j] += op_out(&o[0], m, 1);
+				break;
+			case FM_ALGO_TWO_PAIRS:
+				out[j] += op_out(&o[0], op_mod(&o[1], 0, mod), 2) +
+					  op_out(&o[2], op_mod(&o[3], 0, mod), 2);
+				break;
+#endif
+		}
+
+		for(k=0; k<fm_algo_ops(algo); k++) {
+			o[k].off += o[k].step;
+			o[k].vel += o[k].dvel;
+		}
+	}
+
+	for(k=0; k<fm_algo_ops(algo); k++) {
+		v->op[k].off = o[k].off;
+		v->op[k].vel = o[k].vel;
+	}
+	v->fb = fb;
+}
+
+
+/*
+ * Mix n samples of a multi operator voice, picking the kernel once per block.
+ * FM_ALGO_PAIR voices go through fm_mix instead
+ */
+
+void fm_mix_algo(uint8_t algo, int16_t *out, uint16_t n, struct fm_ops *v, uint8_t mod)
+{
+	switch(algo) {
+		case FM_ALGO_FEEDBACK:
+			fm_algo_run(FM_ALGO_FEEDBACK, out, n, v, mod);
+			break;
+#if FM_OPS == 4
+		case FM_ALGO_STACK3:
+			fm_algo_run(FM_ALGO_STACK3, out, n, v, mod);
+			break;
+		case FM_ALGO_BRANCH:
+			fm_algo_run(FM_ALGO_BRANCH, out, n, v, mod);
+			break;
+		case FM_ALGO_STACK4:
+			fm_algo_run(FM_ALGO_STACK4, out, n, v, mod);
+			break;
+		case FM_ALGO_TWO_PAIRS:
+			fm_algo_run(FM_ALGO_TWO_PAIRS, out, n, v, mod);
+			break;
+#endif
+	}
+}
+
+
+#ifdef FM_CACHE
+
+/*
+ * Baked waveforms. A pair voice repeats every two carrier periods, as the
+ * modulator runs at mul/2 times the carrier, and once the modulator is in its
+ * sustain the waveform no longer changes. The cache holds that waveform, the
+ * table value before the carrier velocity, for the latest FM_CACHE
+ * combinations of ratio, depth and modulator level. The modulator phase is
+ * lined up with the carrier at note on, so one waveform serves all notes.
+ * Entries in use by an osc are never evicted
+ */
+
+#define BAKE_LEN (2 * SINTAB_LEN)
+#define PHASE_MASK ((((phase_t)1 << (PHASE_BITS - 1)) << 1) - 1)
+#define PHASE_HALF ((phase_t)1 << (PHASE_BITS - 1))
+
+struct bake {
+	uint8_t valid;
+	uint8_t mul;
+	uint8_t mod;
+	uint8_t mvel;
+	uint16_t used;		/* Clock of the last lookup */
+	sin_t wave[BAKE_LEN];
+	uint8_t guard[4];	/* The AVX2 gathers read a few bytes past the end */
+};
+
+static struct bake cache[FM_CACHE];
+static uint8_t bake_of[NUM_OSCS];	/* Entry + 1 played by each osc, 0 for none */
+static uint16_t bake_clock;
+
+
+/*
+ * Modulator phase lined up with carrier phase off
+ */
+
+phase_t fm_mod_phase(phase_t off, uint8_t mul)
+{
+	return (off >> 1) * mul + (((off & 1) * mul) >> 1);
+}
+
+
+void fm_bake_free(uint8_t id)
+{
+	bake_of[id] = 0;
+}
+
+
+static uint8_t bake_in_use(uint8_t e)
+{
+	uint8_t i;
+
+	for(i=0; i<NUM_OSCS; i++) {
+		if(bake_of[i] == e + 1) return 1;
+	}
+	return 0;
+}
+
+
+static void bake_fill(struct bake *b)
+{
+	uint16_t i;
+
+	for(i=0; i<BAKE_LEN; i++) {
+		sin_idx_t mi = (uint32_t)i * b->mul / 2;
+		acc_t m = sin_get(mi);
+
+		m = m * b->mvel / 16;
+		m >>= b->mod + SIN_SCALE;
+		b->wave[i] = sin_get((sin_idx_t)(i + MOD_INDEX(m)));
+	}
+}
+
+
+/*
+ * Look up or bake the waveform for osc id. Returns 0 if every entry is in use
+ * by other oscs, the osc then keeps running the FM kernel
+ */
+
+uint8_t fm_bake(uint8_t id, uint8_t mul, uint8_t mod, uint8_t mvel)
+{
+	struct bake *b;
+	uint8_t e;
+	uint8_t best = FM_CACHE;
+
+	fm_bake_free(id);
+	bake_clock ++;
+
+	for(e=0; e<FM_CACHE; e++) {
+		b = &cache[e];
+		if(b->valid && b->mul == mul && b->mod == mod && b->mvel == mvel) break;
+	}
+
+	if(e == FM_CACHE) {
+		for(e=0; e<FM_CACHE; e++) {
+			if(bake_in_use(e)) continue;
+			if(best == FM_CACHE || !cache[e].valid ||
+					(uint16_t)(bake_clock - cache[e].used) > (uint16_t)(bake_clock - cache[best].used)) {
+				best = e;
+			}
+		}
+		if(best == FM_CACHE) return 0;
+
+		e = best;
+		b = &cache[e];
+		b->mul = mul;
+		b->mod = mod;
+		b->mvel = mvel;
+		bake_fill(b);
+		b->valid = 1;
+	}
+
+	cache[e].used = bake_clock;
+	bake_of[id] = e + 1;
+	return 1;
+}
+
+
+/*
+ * Phase in the two carrier periods of the baked waveform, for a voice at
+ * carrier phase off and modulator phase moff. When the phase is no wider than
+ * PHASE_BITS, the modulator tells which of the two periods the carrier is in
+ */
+
+phase_t fm_bake_phase(phase_t off, phase_t moff, uint8_t mul)
+{
+	phase_t d = (moff - fm_mod_phase(off, mul)) & PHASE_MASK;
+	phase_t p = off >> 1;
+
+	if(((d + PHASE_HALF / 2) & PHASE_MASK) >= PHASE_HALF) p += PHASE_HALF;
+	return p & PHASE_MASK;
+}
+
+
+/*
+ * Mix a voice playing a baked waveform. The phase in v->off runs over both
+ * carrier periods of the waveform, at half the carrier step; the modulator is
+ * not used
+ */
+
+void fm_mix_wave(int16_t *out, uint16_t n, struct fm_voice *v, const sin_t *wave)
+{
+	phase_t off = v->off;
+	phase_t step = v->step;
+	uint16_t vel = v->vel;
+	int16_t dvel = v->dvel;
+	uint16_t j;
+
+	for(j=0; j<n; j++) {
+		sin_t w = wave[(off >> (SIN_SHIFT - 1)) & (BAKE_LEN - 1)];
+		out[j] += (acc_t)(uint8_t)(vel >> 8) * w / ((acc_t)MIX_DIV << SIN_SCALE);
+		off += step;
+		vel += dvel;
+	}
+
+	v->off = off;
+	v->vel = vel;
+}
+
+
+/*
+ * Mix the baked waveform of osc id, with the AVX2 kernel when the pair voices
+ * use it
+ */
+
+void fm_mix_baked(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t id)
+{
+	const sin_t *wave = cache[bake_of[id] - 1].wave;
+
+#ifdef HOST
+	if(fm_mix == fm_mix_avx2) {
+		fm_mix_wave_avx2(out, n, v, wave);
+		return;
+	}
+#endif
+	fm_mix_wave(out, n, v, wave);
+}
+
+#endif
+
+
+#ifdef HOST
+
+/*
+ * Table value at a phase, linearly interpolated between the two nearest
+ * entries with the phase bits below the table index
+ */
+
+static inline float sin_lerp(phase_t ph)
+{
+	sin_idx_t i = ph >> SIN_SHIFT;
+	float f = (ph & ((1UL << SIN_SHIFT) - 1)) / (float)(1UL << SIN_SHIFT);
+	float a = sin_get(i);
+
+	return a + (sin_get(i + 1) - a) * f;
+}
+
+
+/*
+ * Higher quality kernel for the host renderer: interpolated table lookups,
+ * the modulation applied at full phase resolution instead of in whole table
+ * entries, and the full precision of the velocity ramps. Not bit exact with
+ * the other kernels
+ */
+
+void fm_mix_lerp(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod)
+{
+	phase_t off = v->off;
+	phase_t moff = v->moff;
+	uint16_t vel = v->vel;
+	uint16_t mvel = v->mvel;
+	float mscale = 1 / 256.0f / 16 / (1 << (mod + SIN_SCALE)) * (1UL << (PHASE_BITS - 8));
+	float scale = 1 / 256.0f / (MIX_DIV << SIN_SCALE);
+	uint16_t j;
+
+	for(j=0; j<n; j++) {
+		int64_t m = sin_lerp(moff) * (mvel * mscale);
+		out[j] += (int16_t)(sin_lerp(off + (phase_t)m) * (vel * scale));
+		off += v->step;
+		moff += v->mstep;
+		vel += v->dvel;
+		mvel += v->dmvel;
+	}
+
+	v->off = off;
+	v->moff = moff;
+	v->vel = vel;
+	v->mvel = mvel;
+}
+
+
+fm_kernel fm_mix = fm_mix_c;
+
+void fm_init(void)
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2") && fm_init_avx2()) {
+		fm_mix = fm_mix_avx2;
+	}
+}
+
+#endif
+
+
+/*
+ * End
+ */
+
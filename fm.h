@@ -0,0 +1,108 @@
+
+#ifndef fm_h
+#define fm_h
+
+/*
+ * FM voice mixing kernels. A kernel renders n samples of one voice and adds
+ * them to out[], advancing the oscillator offsets and the velocity ramps in
+ * the voice. Only the integer part of the velocities is used.
+ */
+
+struct fm_voice {
+	phase_t off;		/* Osc offset in sin table */
+	phase_t step;		/* Osc step size */
+	phase_t moff;		/* Modulator osc offset in sin table */
+	phase_t mstep;		/* Modulator osc step size */
+	uint16_t vel;		/* Osc velocity, Q8.8 */
+	int16_t dvel;		/* Osc velocity increment per sample, Q8.8 */
+	uint16_t mvel;		/* Modulator velocity, Q8.8 */
+	int16_t dmvel;		/* Modulator velocity increment per sample, Q8.8 */
+};
+
+typedef void (*fm_kernel)(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod);
+
+/*
+ * Operator algorithms, from the fewest operators. Operator 0 is always a
+ * carrier and plays at the note frequency; "2 -> 1" means operator 2
+ * modulates operator 1. Each algorithm has its own kernel with the topology
+ * built in, the pair is mixed by fm_mix
+ */
+
+enum fm_algo {
+	FM_ALGO_PAIR,		/* 1 -> 0 */
+	FM_ALGO_FEEDBACK,	/* 1 -> 0, 1 also modulates itself */
+	FM_ALGO_STACK3,		/* 2 -> 1 -> 0 */
+	FM_ALGO_BRANCH,		/* 1 and 2 -> 0 */
+	FM_ALGO_STACK4,		/* 3 -> 2 -> 1 -> 0 */
+	FM_ALGO_TWO_PAIRS,	/* 1 -> 0 and 3 -> 2, two carriers */
+};
+
+/*
+ * Operators per voice, 2 or 4. The AVR has the RAM for the 2 operator
+ * algorithms only
+ */
+
+#ifndef FM_OPS
+#ifdef HOST
+#define FM_OPS 4
+#else
+#define FM_OPS 2
+#endif
+#endif
+
+#if FM_OPS == 4
+#define NUM_FM_ALGOS (FM_ALGO_TWO_PAIRS + 1)
+#elif FM_OPS == 2
+#define NUM_FM_ALGOS (FM_ALGO_FEEDBACK + 1)
+#else
+#error "FM_OPS must be 2 or 4"
+#endif
+
+#define fm_algo_ops(a) ((a) >= FM_ALGO_STACK4 ? 4 : (a) >= FM_ALGO_STACK3 ? 3 : 2)
+
+struct fm_op {
+	phase_t off;		/* Offset in sin table */
+	phase_t step;		/* Step size */
+	uint16_t vel;		/* Velocity, Q8.8 */
+	int16_t dvel;		/* Velocity increment per sample, Q8.8 */
+};
+
+struct fm_ops {
+	struct fm_op op[FM_OPS];
+	int16_t fb;		/* Smoothed output of the feedback operator */
+};
+
+void fm_mix_c(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod);
+void fm_mix_mul(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod);
+void fm_mix_algo(uint8_t algo, int16_t *out, uint16_t n, struct fm_ops *v, uint8_t mod);
+
+/*
+ * Cache of baked waveforms for sustained pair voices, enabled by building
+ * with FM_CACHE set to the number of entries. Each voice is identified by
+ * its osc number, like the pluck voices
+ */
+
+#ifdef FM_CACHE
+phase_t fm_mod_phase(phase_t off, uint8_t mul);
+uint8_t fm_bake(uint8_t id, uint8_t mul, uint8_t mod, uint8_t mvel);
+void fm_bake_free(uint8_t id);
+phase_t fm_bake_phase(phase_t off, phase_t moff, uint8_t mul);
+void fm_mix_baked(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t id);
+void fm_mix_wave(int16_t *out, uint16_t n, struct fm_voice *v, const sin_t *wave);
+#endif
+
+#ifdef HOST
+extern fm_kernel fm_mix;
+void fm_init(void);
+uint8_t fm_init_avx2(void);
+void fm_mix_avx2(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod);
+void fm_mix_lerp(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod);
+#ifdef FM_CACHE
+void fm_mix_wave_avx2(int16_t *out, uint16_t n, struct fm_voice *v, const sin_t *wave);
+#endif
+#else
+#define fm_mix fm_mix_mul
+#define fm_init()
+#endif
+
+#endif
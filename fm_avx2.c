@@ -0,0 +1,398 @@
+
+/*
+ * AVX2 FM voice kernel for the host build. 32 consecutive samples of a voice
+ * are computed per iteration in 16 bit lanes, on the top 16 bits of the
+ * phases. Gathers are slow on many CPUs, so the first quarter of the sine
+ * table is split into 5 rows of 16 bytes and looked up with byte shuffles, 32
+ * lookups per shuffle; the rest of the table mirrors the first quarter. The
+ * output is bit exact with fm_mix_c().
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+#include "hal.h"
+#include "audio.h"
+#include "tables.h"
+#include "fm.h"
+
+#define TARGET __attribute__((target("avx2")))
+
+#define MIX_DIV (64 * NUM_OSCS)
+
+#define LUT_ROWS 5		/* Rows holding entries 0 to SINTAB_LEN/4 */
+
+/*
+ * Sine table rows, each row xor'ed with the previous one and repeated in both
+ * 128 bit lanes for vpshufb
+ */
+
+static int8_t lut[LUT_ROWS][32] __attribute__((aligned(32)));
+
+
+/*
+ * Build the lookup rows. Returns 0 if the sine table is not the default 256
+ * entry, 8 bit table or is not symmetric, in which case this kernel can not
+ * be used
+ */
+
+uint8_t fm_init_avx2(void)
+{
+	uint16_t i;
+
+	if(SINTAB_ORDER != 8 || SINTAB_BITS != 8 || sin_get(0) != 0) return 0;
+
+	for(i=0; i<SINTAB_LEN/2; i++) {
+		if(sin_get(i + SINTAB_LEN/2) != -sin_get(i)) return 0;
+		if(i > SINTAB_LEN/4 && sin_get(i) != sin_get(SINTAB_LEN/2 - i)) return 0;
+	}
+
+	for(i=0; i<LUT_ROWS*16; i++) {
+		int8_t v = i <= SINTAB_LEN/4 ? sin_get(i) : 0;
+		if(i >= 16) v ^= i - 16 <= SINTAB_LEN/4 ? sin_get(i - 16) : 0;
+		lut[i >> 4][i & 15] = v;
+		lut[i >> 4][(i & 15) + 16] = v;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Look up the magnitudes of the sine table at 32 byte indices. An index in
+ * the second quarter of a half wave is mirrored into the first. Row k is
+ * shuffled with the index minus 16 * k, which has bit 7 set, giving zero, for
+ * all rows past the one holding the index; xor'ing the rows up to there
+ * leaves the table value. The sign is applied to the products, see sign()
+ */
+
+TARGET static inline __m256i lookup(__m256i idx)
+{
+	__m256i t = _mm256_and_si256(idx, _mm256_set1_epi8(0x7f));
+	__m256i r = _mm256_setzero_si256();
+	const __m256i row = _mm256_set1_epi8(16);
+	int k;
+
+	/* 0x80 is half of the 256 entry table, the only one fm_init_avx2() takes */
+	t = _mm256_min_epu8(t, _mm256_sub_epi8(_mm256_set1_epi8((char)0x80), t));
+
+	for(k=0; k<LUT_ROWS; k++) {
+		r = _mm256_xor_si256(r, _mm256_shuffle_epi8(_mm256_load_si256((__m256i *)lut[k]), t));
+		t = _mm256_sub_epi8(t, row);
+	}
+
+	return r;
+}
+
+
+/*
+ * Give the magnitudes x the sign of the table values at the indices idx, in
+ * 16 bit lanes. Indices in the second half of the table have bit 7 set; at
+ * index 0 the table value is 0 and so is the result. Dividing the magnitudes
+ * before applying the sign truncates towards zero like C division does
+ */
+
+TARGET static inline __m256i sign(__m256i x, __m256i idx)
+{
+	return _mm256_sign_epi16(x, _mm256_slli_epi16(idx, 8));
+}
+
+
+/*
+ * Division of the magnitudes by the mix divisor. When it is not a power of
+ * two, the power of two part is shifted out and the rest of the product,
+ * below 512, is divided by NUM_OSCS with a 17 bit reciprocal as in fm.c
+ */
+
+TARGET static inline __m256i div_mix(__m256i x)
+{
+	if((MIX_DIV & (MIX_DIV - 1)) == 0) {
+		return _mm256_srli_epi16(x, __builtin_ctz(MIX_DIV));
+	} else {
+		const __m256i r = _mm256_set1_epi16(((1UL << 17) + NUM_OSCS - 1) / NUM_OSCS);
+		return _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_srli_epi16(x, 6), r), 1);
+	}
+}
+
+
+/*
+ * Zero extend the table magnitudes back into the 16 bit lane order of the
+ * offsets they were looked up for; unpack undoes the lane order of packus
+ */
+
+TARGET static inline __m256i widen_lo(__m256i x)
+{
+	return _mm256_unpacklo_epi8(x, _mm256_setzero_si256());
+}
+
+TARGET static inline __m256i widen_hi(__m256i x)
+{
+	return _mm256_unpackhi_epi8(x, _mm256_setzero_si256());
+}
+
+
+#if PHASE_BITS > 16
+
+/*
+ * Table indices, the top bytes of the phases, of 16 samples in 16 bit lanes.
+ * The phases are kept in the top bits of the 32 bit lanes, so they wrap by
+ * themselves, with the even samples in lo and the odd ones in hi; a blend of
+ * the two words then leaves the samples in order
+ */
+
+TARGET static inline __m256i phase_idx(__m256i lo, __m256i hi)
+{
+	return _mm256_blend_epi16(_mm256_srli_epi32(lo, 24), _mm256_srli_epi32(hi, 8), 0xaa);
+}
+
+#endif
+
+
+/*
+ * Lane masks for the last run of a block, see below
+ */
+
+static const int16_t keep[64] __attribute__((aligned(32))) = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+
+/*
+ * Blocks are cut at the ADSR period of 176 samples and at sequencer ticks,
+ * so most calls end in a partial run of 32 samples. The last run is moved
+ * back to end at the end of the block, and the samples it overlaps with the
+ * run before are masked out, so all samples take the vector path. Blocks
+ * shorter than a run use the scalar kernel
+ */
+
+TARGET void fm_mix_avx2(int16_t *out, uint16_t n, struct fm_voice *v, uint8_t mod)
+{
+	uint16_t j;
+	uint16_t rem = n % 32;
+	uint16_t back = 32 - rem;
+
+	if(n < 32) {
+		fm_mix_c(out, n, v, mod);
+		return;
+	}
+
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	const __m256i lane = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i sh = _mm_cvtsi32_si128(mod);
+	__m256i keep_a = _mm256_set1_epi16(-1);
+	__m256i keep_b = keep_a;
+
+	/* Velocity ramps for samples 0..15 in a, 16..31 in b */
+
+	const __m256i dvel = _mm256_set1_epi16(v->dvel * 32);
+	const __m256i dmvel = _mm256_set1_epi16(v->dmvel * 32);
+	__m256i vel_a = _mm256_add_epi16(_mm256_set1_epi16(v->vel), _mm256_mullo_epi16(lane, _mm256_set1_epi16(v->dvel)));
+	__m256i vel_b = _mm256_add_epi16(vel_a, _mm256_set1_epi16(v->dvel * 16));
+	__m256i mvel_a = _mm256_add_epi16(_mm256_set1_epi16(v->mvel), _mm256_mullo_epi16(lane, _mm256_set1_epi16(v->dmvel)));
+	__m256i mvel_b = _mm256_add_epi16(mvel_a, _mm256_set1_epi16(v->dmvel * 16));
+
+#if PHASE_BITS == 16
+
+	/* Offsets for samples 0..15 in a, 16..31 in b */
+
+	const __m256i step = _mm256_set1_epi16(v->step * 32);
+	const __m256i mstep = _mm256_set1_epi16(v->mstep * 32);
+	__m256i off_a = _mm256_add_epi16(_mm256_set1_epi16(v->off), _mm256_mullo_epi16(lane, _mm256_set1_epi16(v->step)));
+	__m256i off_b = _mm256_add_epi16(off_a, _mm256_set1_epi16(v->step * 16));
+	__m256i moff_a = _mm256_add_epi16(_mm256_set1_epi16(v->moff), _mm256_mullo_epi16(lane, _mm256_set1_epi16(v->mstep)));
+	__m256i moff_b = _mm256_add_epi16(moff_a, _mm256_set1_epi16(v->mstep * 16));
+
+#else
+
+	/* Full offsets, shifted to the top of the lanes, for the even samples
+	 * 0..14 and the odd samples 1..15, then 16..30 and 17..31 */
+
+	const __m256i lane32 = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+	const uint32_t st = (uint32_t)v->step << (32 - PHASE_BITS);
+	const uint32_t mst = (uint32_t)v->mstep << (32 - PHASE_BITS);
+	const __m256i step = _mm256_set1_epi32(st * 32);
+	const __m256i mstep = _mm256_set1_epi32(mst * 32);
+	__m256i off[4], moff[4];
+	int k;
+
+	off[0] = _mm256_add_epi32(_mm256_set1_epi32((uint32_t)v->off << (32 - PHASE_BITS)), _mm256_mullo_epi32(lane32, _mm256_set1_epi32(st)));
+	moff[0] = _mm256_add_epi32(_mm256_set1_epi32((uint32_t)v->moff << (32 - PHASE_BITS)), _mm256_mullo_epi32(lane32, _mm256_set1_epi32(mst)));
+	off[1] = _mm256_add_epi32(off[0], _mm256_set1_epi32(st));
+	moff[1] = _mm256_add_epi32(moff[0], _mm256_set1_epi32(mst));
+	for(k=2; k<4; k++) {
+		off[k] = _mm256_add_epi32(off[k-2], _mm256_set1_epi32(st * 16));
+		moff[k] = _mm256_add_epi32(moff[k-2], _mm256_set1_epi32(mst * 16));
+	}
+
+#endif
+
+	for(j=0; j<n; j+=32) {
+		__m256i s, m_a, m_b, c_a, c_b;
+
+		/* Last partial run: step back to end at n, keep only the samples
+		 * past the previous run */
+
+		if(j + 32 > n) {
+			vel_a = _mm256_sub_epi16(vel_a, _mm256_set1_epi16(v->dvel * back));
+			vel_b = _mm256_sub_epi16(vel_b, _mm256_set1_epi16(v->dvel * back));
+			mvel_a = _mm256_sub_epi16(mvel_a, _mm256_set1_epi16(v->dmvel * back));
+			mvel_b = _mm256_sub_epi16(mvel_b, _mm256_set1_epi16(v->dmvel * back));
+#if PHASE_BITS == 16
+			off_a = _mm256_sub_epi16(off_a, _mm256_set1_epi16(v->step * back));
+			off_b = _mm256_sub_epi16(off_b, _mm256_set1_epi16(v->step * back));
+			moff_a = _mm256_sub_epi16(moff_a, _mm256_set1_epi16(v->mstep * back));
+			moff_b = _mm256_sub_epi16(moff_b, _mm256_set1_epi16(v->mstep * back));
+#else
+			for(k=0; k<4; k++) {
+				off[k] = _mm256_sub_epi32(off[k], _mm256_set1_epi32(st * back));
+				moff[k] = _mm256_sub_epi32(moff[k], _mm256_set1_epi32(mst * back));
+			}
+#endif
+			keep_a = _mm256_loadu_si256((__m256i *)(keep + rem));
+			keep_b = _mm256_loadu_si256((__m256i *)(keep + rem + 16));
+			j = n - 32;
+		}
+
+#if PHASE_BITS == 16
+		__m256i i_a = _mm256_srli_epi16(off_a, 8);
+		__m256i i_b = _mm256_srli_epi16(off_b, 8);
+		__m256i mi_a = _mm256_srli_epi16(moff_a, 8);
+		__m256i mi_b = _mm256_srli_epi16(moff_b, 8);
+#else
+		__m256i i_a = phase_idx(off[0], off[1]);
+		__m256i i_b = phase_idx(off[2], off[3]);
+		__m256i mi_a = phase_idx(moff[0], moff[1]);
+		__m256i mi_b = phase_idx(moff[2], moff[3]);
+#endif
+
+		/* Modulator */
+
+		s = lookup(_mm256_packus_epi16(mi_a, mi_b));
+		m_a = _mm256_srli_epi16(_mm256_mullo_epi16(widen_lo(s), _mm256_srli_epi16(mvel_a, 8)), 4);
+		m_b = _mm256_srli_epi16(_mm256_mullo_epi16(widen_hi(s), _mm256_srli_epi16(mvel_b, 8)), 4);
+		m_a = _mm256_sra_epi16(sign(m_a, mi_a), sh);
+		m_b = _mm256_sra_epi16(sign(m_b, mi_b), sh);
+
+		/* Carrier */
+
+		m_a = _mm256_and_si256(_mm256_add_epi16(i_a, m_a), mask);
+		m_b = _mm256_and_si256(_mm256_add_epi16(i_b, m_b), mask);
+		s = lookup(_mm256_packus_epi16(m_a, m_b));
+		c_a = sign(div_mix(_mm256_mullo_epi16(widen_lo(s), _mm256_srli_epi16(vel_a, 8))), m_a);
+		c_b = sign(div_mix(_mm256_mullo_epi16(widen_hi(s), _mm256_srli_epi16(vel_b, 8))), m_b);
+		if(j + 32 == n) {
+			c_a = _mm256_and_si256(c_a, keep_a);
+			c_b = _mm256_and_si256(c_b, keep_b);
+		}
+
+		__m256i *o = (__m256i *)(out + j);
+		_mm256_storeu_si256(o, _mm256_add_epi16(_mm256_loadu_si256(o), c_a));
+		_mm256_storeu_si256(o + 1, _mm256_add_epi16(_mm256_loadu_si256(o + 1), c_b));
+
+		vel_a = _mm256_add_epi16(vel_a, dvel);
+		vel_b = _mm256_add_epi16(vel_b, dvel);
+		mvel_a = _mm256_add_epi16(mvel_a, dmvel);
+		mvel_b = _mm256_add_epi16(mvel_b, dmvel);
+
+#if PHASE_BITS == 16
+		off_a = _mm256_add_epi16(off_a, step);
+		off_b = _mm256_add_epi16(off_b, step);
+		moff_a = _mm256_add_epi16(moff_a, mstep);
+		moff_b = _mm256_add_epi16(moff_b, mstep);
+#else
+		for(k=0; k<4; k++) {
+			off[k] = _mm256_add_epi32(off[k], step);
+			moff[k] = _mm256_add_epi32(moff[k], mstep);
+		}
+#endif
+	}
+
+	v->off += v->step * n;
+	v->moff += v->mstep * n;
+	v->vel += v->dvel * n;
+	v->mvel += v->dmvel * n;
+}
+
+
+#ifdef FM_CACHE
+
+/*
+ * Division of 32 bit lanes by the mix divisor, truncating towards zero
+ */
+
+TARGET static inline __m256i div_mix32(__m256i x)
+{
+	const int d = MIX_DIV << SIN_SCALE;
+
+	if((d & (d - 1)) == 0) {
+		__m256i bias = _mm256_and_si256(_mm256_srai_epi32(x, 31), _mm256_set1_epi32(d - 1));
+		return _mm256_srai_epi32(_mm256_add_epi32(x, bias), __builtin_ctz(d));
+	} else {
+		return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(d)));
+	}
+}
+
+
+/*
+ * Baked waveform kernel, bit exact with fm_mix_wave(). 16 samples per
+ * iteration in two sets of 32 bit lanes; the waveform has 2 * SINTAB_LEN
+ * entries, too many for the shuffle lookup, so the values are gathered as 32
+ * bit words at their byte offset and sign extended from the low bytes
+ */
+
+TARGET void fm_mix_wave_avx2(int16_t *out, uint16_t n, struct fm_voice *v, const sin_t *wave)
+{
+	uint16_t j;
+	uint16_t n16 = n & ~15;
+
+	const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i mask = _mm256_set1_epi32(2 * SINTAB_LEN - 1);
+	const __m256i step = _mm256_set1_epi32((uint32_t)v->step * 16);
+	const __m256i dvel = _mm256_set1_epi32(v->dvel * 16);
+	const __m256i vmask = _mm256_set1_epi32(0xff);
+	const int ext = 32 - 8 * sizeof(sin_t);
+	__m256i off_a, off_b, vel_a, vel_b;
+
+	off_a = _mm256_add_epi32(_mm256_set1_epi32(v->off), _mm256_mullo_epi32(lane, _mm256_set1_epi32(v->step)));
+	off_b = _mm256_add_epi32(off_a, _mm256_set1_epi32((uint32_t)v->step * 8));
+	vel_a = _mm256_add_epi32(_mm256_set1_epi32(v->vel), _mm256_mullo_epi32(lane, _mm256_set1_epi32(v->dvel)));
+	vel_b = _mm256_add_epi32(vel_a, _mm256_set1_epi32(v->dvel * 8));
+
+	for(j=0; j<n16; j+=16) {
+		__m256i *o = (__m256i *)(out + j);
+		__m256i i_a, i_b, w_a, w_b, c;
+
+		i_a = _mm256_and_si256(_mm256_srli_epi32(off_a, SIN_SHIFT - 1), mask);
+		i_b = _mm256_and_si256(_mm256_srli_epi32(off_b, SIN_SHIFT - 1), mask);
+		w_a = _mm256_i32gather_epi32((const int *)wave, i_a, sizeof(sin_t));
+		w_b = _mm256_i32gather_epi32((const int *)wave, i_b, sizeof(sin_t));
+		w_a = _mm256_srai_epi32(_mm256_slli_epi32(w_a, ext), ext);
+		w_b = _mm256_srai_epi32(_mm256_slli_epi32(w_b, ext), ext);
+
+		w_a = div_mix32(_mm256_mullo_epi32(w_a, _mm256_and_si256(_mm256_srli_epi32(vel_a, 8), vmask)));
+		w_b = div_mix32(_mm256_mullo_epi32(w_b, _mm256_and_si256(_mm256_srli_epi32(vel_b, 8), vmask)));
+		c = _mm256_permute4x64_epi64(_mm256_packs_epi32(w_a, w_b), 0xd8);
+
+		_mm256_storeu_si256(o, _mm256_add_epi16(_mm256_loadu_si256(o), c));
+
+		off_a = _mm256_add_epi32(off_a, step);
+		off_b = _mm256_add_epi32(off_b, step);
+		vel_a = _mm256_add_epi32(vel_a, dvel);
+		vel_b = _mm256_add_epi32(vel_b, dvel);
+	}
+
+	v->off += v->step * n16;
+	v->vel += v->dvel * n16;
+	fm_mix_wave(out + n16, n - n16, v, wave);
+}
+
+#endif
+
+/*
+ * End
+ */
+
@@ -0,0 +1,225 @@
+
+/*
+ * Sample bank generator, run on the build host. Synthesizes the built in
+ * instrument samples and writes them as a sample bank, either as C source
+ * for the firmware or as a binary bank file which piano-host can map.
+ *
+ * usage: genbank > bank.c
+ *        genbank -o bank.bin
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "hal.h"
+#include "tables.h"
+#include "sample.h"
+
+#ifndef SRATE
+#define SRATE 15625
+#endif
+
+#if SRATE > 65535
+#error "SRATE must fit the 16 bit rate field of the bank header"
+#endif
+
+#define HARMS 8
+#define MAX_LEN 8192
+#define PER_LINE 16
+
+/*
+ * Instruments are made of harmonics. The bright amplitudes fade into the
+ * steady ones during the attack, after which the loop repeats a whole number
+ * of periods. Samples without loop decay instead
+ */
+
+struct instr {
+	const char *name;
+	uint8_t root;
+	uint8_t mode;
+	uint16_t attack;
+	float steady[HARMS];
+	float bright[HARMS];
+	float ratio[HARMS];	/* Partial frequencies, harmonic when 0 */
+	uint16_t len;		/* Length of samples without loop */
+	float decay;		/* Decay time in seconds of samples without loop */
+};
+
+static const struct instr instrs[] = {
+	{
+		.name = "clarinet", .root = 34, .mode = LOOP_FORWARD, .attack = 512,
+		.steady = { 1, 0, 0.35, 0, 0.2, 0, 0.12, 0 },
+		.bright = { 0.6, 0, 0.5, 0, 0.3, 0, 0.2, 0 },
+	}, {
+		.name = "electric guitar", .root = 22, .mode = LOOP_FORWARD, .attack = 1024,
+		.steady = { 1, 0.5, 0.33, 0.25, 0.2, 0.16, 0.14, 0.12 },
+		.bright = { 1, 0.8, 0.7, 0.6, 0.5, 0.5, 0.4, 0.4 },
+	}, {
+		.name = "oboe", .root = 38, .mode = LOOP_FORWARD, .attack = 384,
+		.steady = { 0.4, 1, 0.8, 0.5, 0.3, 0.2, 0.1, 0.05 },
+		.bright = { 0.2, 0.6, 0.8, 0.7, 0.5, 0.3, 0.2, 0.1 },
+	}, {
+		.name = "violin", .root = 36, .mode = LOOP_REVERSE, .attack = 768,
+		.steady = { 1, 0.5, 0.33, 0.25, 0.2, 0.16, 0.14, 0.12 },
+		.bright = { 0.3, 0.2, 0.15, 0.1, 0.1, 0.1, 0.1, 0.1 },
+	}, {
+		.name = "xylophone", .root = 48, .mode = LOOP_NONE,
+		.steady = { 1, 0.3, 0.1 },
+		.ratio = { 1, 3.93, 9.17 },
+		.len = 4096, .decay = 0.12,
+	},
+};
+
+#define NUM_INSTRS (sizeof instrs / sizeof instrs[0])
+
+static int8_t pcm[NUM_INSTRS][MAX_LEN];
+static uint32_t pcm_len[NUM_INSTRS];
+static uint32_t loop_start[NUM_INSTRS];
+static FILE *fout;
+static int as_c = 1;
+static long n_out = 0;
+
+
+/*
+ * Render one instrument. Looped samples get a loop of a whole number of
+ * periods of about 1000 samples, the pitch is tuned to fit it exactly
+ */
+
+static void render(int n)
+{
+	const struct instr *in = &instrs[n];
+	float f = F_NOTE0 * pow(2, in->root / 12.0);
+	float buf[MAX_LEN];
+	float peak = 0;
+	uint32_t len, i;
+	int h;
+
+	if(in->mode == LOOP_NONE) {
+		len = in->len;
+		loop_start[n] = len;
+	} else {
+		uint32_t periods = round(1000 * f / SRATE);
+		uint32_t loop = round(periods * SRATE / f);
+		f = (float)periods * SRATE / loop;
+		loop_start[n] = in->attack;
+		len = in->attack + loop;
+	}
+
+	for(i=0; i<len; i++) {
+		float t = (float)i / SRATE;
+		float v = 0;
+		for(h=0; h<HARMS; h++) {
+			float a = in->steady[h];
+			float r = in->ratio[h] ? in->ratio[h] : h + 1;
+			if(in->mode == LOOP_NONE) {
+				a *= exp(-t * r / in->decay);
+			} else if(i < in->attack) {
+				float w = 1 - (float)i / in->attack;
+				a += (in->bright[h] - a) * w * w;
+				if(i < 32) a *= i / 32.0;
+			}
+			v += a * sin(2 * M_PI * f * r * t);
+		}
+		buf[i] = v;
+		if(fabs(v) > peak) peak = fabs(v);
+	}
+
+	for(i=0; i<len; i++) pcm[n][i] = lround(buf[i] * 120 / peak);
+	pcm_len[n] = len;
+}
+
+
+static void put_byte(uint8_t b)
+{
+	if(!as_c) {
+		fputc(b, fout);
+		return;
+	}
+	if(n_out % PER_LINE == 0) fprintf(fout, "\t");
+	fprintf(fout, "%d,", b);
+	fprintf(fout, n_out % PER_LINE == PER_LINE-1 ? "\n" : " ");
+	n_out ++;
+}
+
+
+static void put_le(uint32_t v, int n)
+{
+	while(n--) {
+		put_byte(v & 0xff);
+		v >>= 8;
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *fname = NULL;
+	uint32_t off;
+	uint32_t i, j;
+	int c;
+
+	while((c = getopt(argc, argv, "o:")) != -1) {
+		switch(c) {
+			case 'o':
+				fname = optarg;
+				as_c = 0;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-o bank.bin]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	fout = fname ? fopen(fname, "wb") : stdout;
+	if(fout == NULL) {
+		perror(fname);
+		return 1;
+	}
+
+	for(i=0; i<NUM_INSTRS; i++) render(i);
+
+	if(as_c) {
+		fprintf(fout, "\n/*\n * Generated by genbank for %d Hz:", SRATE);
+		for(i=0; i<NUM_INSTRS; i++) fprintf(fout, "%s %s", i ? "," : "", instrs[i].name);
+		fprintf(fout, ".\n * Do not edit\n */\n\n");
+		fprintf(fout, "#include <stdint.h>\n\n#include \"hal.h\"\n\n");
+		fprintf(fout, "const uint8_t sample_bank_builtin[] PROGMEM = {\n");
+	}
+
+	for(i=0; i<4; i++) put_byte(BANK_MAGIC[i]);
+	put_le(NUM_INSTRS, 2);
+	put_le(SRATE, 2);
+
+	off = BANK_HEADER_LEN + NUM_INSTRS * BANK_ENTRY_LEN;
+	for(i=0; i<NUM_INSTRS; i++) {
+		put_le(off, 4);
+		put_le(pcm_len[i], 4);
+		put_le(loop_start[i], 4);
+		put_byte(instrs[i].mode);
+		put_byte(instrs[i].root);
+		put_le(0, 2);
+		off += pcm_len[i];
+	}
+
+	for(i=0; i<NUM_INSTRS; i++) {
+		for(j=0; j<pcm_len[i]; j++) put_byte(pcm[i][j]);
+	}
+
+	if(as_c) {
+		if(n_out % PER_LINE) fprintf(fout, "\n");
+		fprintf(fout, "};\n\n/*\n * End\n */\n\n");
+	}
+
+	if(fout != stdout) fclose(fout);
+	return 0;
+}
+
+
+/*
+ * End
+ */
+
@@ -0,0 +1,93 @@
+
+/*
+ * Table generator, run on the build host: writes the C source of the sine
+ * and note step tables to stdout. It is compiled with the same SRATE and
+ * SINTAB_* flags as the firmware, so the tables always match the build.
+ *
+ * usage: gentab > tables.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "hal.h"
+#include "audio.h"
+#include "tables.h"
+
+#define PER_LINE 16
+
+
+static void put_value(int i, int n, long v)
+{
+	if(i % PER_LINE == 0) printf("\t");
+	printf("%ld,", v);
+	printf((i % PER_LINE == PER_LINE-1 || i == n-1) ? "\n" : " ");
+}
+
+
+int main(void)
+{
+	long amp = (1L << (SINTAB_BITS - 1)) - 1;
+	int i;
+
+#if SINTAB_BITS < 8 || SINTAB_BITS > 16
+	fprintf(stderr, "gentab: SINTAB_BITS must be 8 to 16\n");
+	return 1;
+#endif
+#if SINTAB_ORDER < 4 || SINTAB_ORDER > 12
+	fprintf(stderr, "gentab: SINTAB_ORDER must be 4 to 12\n");
+	return 1;
+#endif
+#if PHASE_BITS != 16 && PHASE_BITS != 24 && PHASE_BITS != 32
+	fprintf(stderr, "gentab: PHASE_BITS must be 16, 24 or 32\n");
+	return 1;
+#endif
+
+	printf("\n/*\n");
+	printf(" * Generated by gentab for %d Hz, %d bit phase, %d entries of %d bits%s.\n",
+			SRATE, PHASE_BITS, SINTAB_LEN, SINTAB_BITS,
+			SINTAB_SIZE < SINTAB_LEN ? ", quarter wave" : "");
+	printf(" * Do not edit\n");
+	printf(" */\n\n");
+	printf("#include <stdint.h>\n\n");
+	printf("#include \"hal.h\"\n");
+	printf("#include \"tables.h\"\n\n");
+
+	/* Truncated like the original hand made table, which this reproduces */
+
+	printf("const sin_t sintab[SINTAB_SIZE] PROGMEM = {\n");
+	for(i=0; i<SINTAB_SIZE; i++) {
+		put_value(i, SINTAB_SIZE, (long)(amp * sin(2 * M_PI * i / SINTAB_LEN)));
+	}
+	printf("};\n\n");
+
+	/* Phase steps of all notes, the lowest octave shifted up. Steps past
+	 * the phase width wrap, as they would at run time */
+
+	printf("const uint32_t notetab[NUM_NOTES] PROGMEM = {\n");
+	for(i=0; i<NUM_NOTES; i++) {
+		uint32_t step = F_NOTE0 * pow(2, i % 12 / 12.0) * pow(2, PHASE_BITS) / SRATE;
+		put_value(i, NUM_NOTES, (uint32_t)(step << (i / 12)));
+	}
+	printf("};\n\n");
+
+	/* Semitone ratios for transposing samples */
+
+	printf("const uint16_t semitab[12] PROGMEM = {\n");
+	for(i=0; i<12; i++) {
+		put_value(i, 12, lround(pow(2, i / 12.0) * 4096));
+	}
+	printf("};\n\n");
+
+	printf("/*\n * End\n */\n\n");
+
+	return 0;
+}
+
+
+/*
+ * End
+ */
+
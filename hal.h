@@ -0,0 +1,97 @@
+
+#ifndef hal_h
+#define hal_h
+
+/*
+ * Hardware abstraction. On the AVR this simply pulls in the avr-libc headers,
+ * on the host (-DHOST) the registers, interrupts and delays used by the
+ * firmware are emulated by hal_host.c so the synth engine can run unmodified
+ * on a workstation.
+ */
+
+#ifndef HOST
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+/* Byte loads and stores are atomic, the barriers keep the compiler from
+ * moving other memory accesses across them */
+
+#define load_acquire(p) ({ typeof(*(p)) _v = *(volatile typeof(*(p)) *)(p); __asm__ __volatile__("" ::: "memory"); _v; })
+#define store_release(p, v) do { __asm__ __volatile__("" ::: "memory"); *(volatile typeof(*(p)) *)(p) = (v); } while(0)
+
+#else
+
+#include <stdint.h>
+#include <string.h>
+
+/* Interrupts: handlers become plain functions called by hal_run() */
+
+#define ISR(vect, ...) void vect(void)
+#define ISR_NOBLOCK
+#define sei()
+#define cli()
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for(uint8_t _once = 1; _once; _once = 0)
+
+void TIMER2_COMPA_vect(void);
+
+/* Ordered accesses for data shared between threads */
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* Flash access */
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define memcpy_P memcpy
+
+/* Delays take no time, the host runs as fast as it can */
+
+static inline void _delay_ms(double ms) { (void)ms; }
+static inline void _delay_us(double us) { (void)us; }
+
+/* Emulated I/O registers. PORTB doubles as the profiling probe port */
+
+extern volatile uint8_t DDRA, PORTA, PINA;
+extern volatile uint8_t DDRB, PORTB;
+extern volatile uint8_t DDRC, PORTC;
+extern volatile uint8_t DDRD, PORTD;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t OCR1A;
+extern volatile uint8_t TCCR2A, TCCR2B, TIMSK2, OCR2A;
+
+#define WGM10	0
+#define WGM11	1
+#define COM1A1	7
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define WGM12	3
+#define TOIE1	0
+
+#define WGM21	1
+#define CS21	1
+#define OCIE2A	1
+
+#define PD5	5
+
+/*
+ * Run the emulated timers for the given number of CPU cycles, calling the
+ * timer 2 compare handler when enabled. The pwm callback is called with the
+ * OCR1A value at every timer 1 overflow.
+ */
+
+void hal_run(uint32_t cycles, void (*pwm)(uint16_t val));
+
+#endif
+
+#endif
+
@@ -0,0 +1,55 @@
+
+/*
+ * Host emulation of the bits of the ATmega644 used by the synth engine
+ */
+
+#include <stdint.h>
+
+#include "hal.h"
+
+/* Timer periods in CPU cycles for the configuration set by audio_init() */
+
+#define T1_PERIOD (512)			/* clk/1, 9 bit fast PWM */
+#define T2_PERIOD ((OCR2A + 1) * 8)	/* clk/8, CTC */
+
+volatile uint8_t DDRA, PORTA, PINA = 0xff;
+volatile uint8_t DDRB, PORTB;
+volatile uint8_t DDRC, PORTC;
+volatile uint8_t DDRD, PORTD;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t OCR1A;
+volatile uint8_t TCCR2A, TCCR2B, TIMSK2, OCR2A;
+
+static uint32_t t1_cnt = 0;
+static uint32_t t2_cnt = 0;
+
+
+void hal_run(uint32_t cycles, void (*pwm)(uint16_t val))
+{
+	while(cycles) {
+
+		uint32_t n = cycles;
+		if(T1_PERIOD - t1_cnt < n) n = T1_PERIOD - t1_cnt;
+		if(T2_PERIOD - t2_cnt < n) n = T2_PERIOD - t2_cnt;
+
+		t1_cnt += n;
+		t2_cnt += n;
+		cycles -= n;
+
+		if(t2_cnt >= T2_PERIOD) {
+			t2_cnt = 0;
+			if(TIMSK2 & (1<<OCIE2A)) TIMER2_COMPA_vect();
+		}
+
+		if(t1_cnt == T1_PERIOD) {
+			t1_cnt = 0;
+			if(pwm) pwm(OCR1A);
+		}
+	}
+}
+
+
+/*
+ * End
+ */
+
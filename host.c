@@ -0,0 +1,378 @@
+
+/*
+ * Host driver: runs the firmware audio engine as fast as possible, plays the
+ * demo tune or a tune loaded from file, and writes the output as 16 bit PCM in
+ * WAV or raw format. Audio is rendered with render_block(), or with -t through
+ * the audio ISR on the emulated timers as on the device.
+ *
+ * usage: piano-host [-a algo] [-b] [-d style] [-f tick] [-i instr] [-k kernel] [-r] [-s bank] [-t] [-o out.wav] [tune.c]
+ *
+ * Tune files use the same { ticks, note } format as bach.c. Sample banks are
+ * mapped into memory rather than read, so large banks load instantly
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hal.h"
+#include "audio.h"
+#include "seq.h"
+#include "tables.h"
+#include "fm.h"
+#include "sample.h"
+#include "rhythm.h"
+
+#define CYCLES_PER_SAMPLE (F_CPU / SRATE)	/* One timer 2 compare per sample */
+#define CHUNK 1024		/* Samples per render_block() or hal_run() call */
+#define TAIL (SRATE / 2)	/* Samples rendered after the tune ends */
+#define BENCH (SRATE * 60)	/* Samples rendered in benchmark mode */
+
+static FILE *fout = NULL;
+static int16_t buf[CHUNK];
+static uint32_t buf_len = 0;
+static uint32_t samples = 0;
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void put_le(uint32_t v, int n)
+{
+	while(n--) {
+		fputc(v & 0xff, fout);
+		v >>= 8;
+	}
+}
+
+
+static void write_wav_header(uint32_t n)
+{
+	fwrite("RIFF", 1, 4, fout);
+	put_le(36 + n * 2, 4);
+	fwrite("WAVEfmt ", 1, 8, fout);
+	put_le(16, 4);			/* fmt chunk size */
+	put_le(1, 2);			/* PCM */
+	put_le(1, 2);			/* mono */
+	put_le(SRATE, 4);
+	put_le(SRATE * 2, 4);		/* bytes per second */
+	put_le(2, 2);			/* block align */
+	put_le(16, 2);			/* bits per sample */
+	fwrite("data", 1, 4, fout);
+	put_le(n * 2, 4);
+}
+
+
+static void flush(void)
+{
+	uint32_t i;
+
+	if(fout) {
+		for(i=0; i<buf_len; i++) put_le((uint16_t)buf[i], 2);
+	}
+	buf_len = 0;
+}
+
+
+/*
+ * Output one sample, the 9 bit engine output is scaled to 16 bit PCM
+ */
+
+static void put_sample(int16_t c)
+{
+	buf[buf_len++] = c * 128;
+	if(buf_len == CHUNK) flush();
+	samples ++;
+}
+
+
+static void render(uint32_t n)
+{
+	int16_t out[CHUNK];
+	uint32_t i, len;
+
+	while(n) {
+		len = n < CHUNK ? n : CHUNK;
+		render_block(out, len);
+		for(i=0; i<len; i++) put_sample(out[i]);
+		n -= len;
+	}
+}
+
+
+/*
+ * Called on every timer 1 overflow, every 512 cycles; the PWM output is
+ * sampled at the sample rate.
+ */
+
+static void pwm(uint16_t val)
+{
+	static uint32_t t = 0;
+
+	t += 512;
+	if(t < CYCLES_PER_SAMPLE) return;
+	t -= CYCLES_PER_SAMPLE;
+
+	put_sample(val - 256);
+}
+
+
+static int load_tune(const char *fname)
+{
+	FILE *f;
+	char line[128];
+	unsigned ticks;
+	int note, n = 0;
+
+	f = fopen(fname, "r");
+	if(f == NULL) {
+		perror(fname);
+		return -1;
+	}
+
+	seq_cmd(SEQ_CMD_CLEAR);
+
+	while(fgets(line, sizeof line, f)) {
+		if(sscanf(line, " { %u , %i }", &ticks, &note) != 2) continue;
+		/* Bit 7 of the note byte marks a key press, as in bach.c */
+		if(ticks > 0xffff || note < 0 || note > 0xff) {
+			fprintf(stderr, "%s: event %d out of range\n", fname, n);
+			fclose(f);
+			return -1;
+		}
+		if(!seq_append(ticks, note)) {
+			fprintf(stderr, "%s: event %d out of order or list full\n", fname, n);
+			fclose(f);
+			return -1;
+		}
+		n ++;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/*
+ * Check that the sample table and the PCM data of every sample lie within
+ * the len bytes of the bank, so the mixer never reads past the mapping.
+ * Lengths must fit the Q20.12 sample positions
+ */
+
+static int bank_valid(const uint8_t *b, size_t len)
+{
+	uint32_t n, i, off, end, loop;
+	const uint8_t *e;
+
+	if(len < BANK_HEADER_LEN || memcmp(b, BANK_MAGIC, 4) != 0) return 0;
+	n = b[4] | (b[5] << 8);
+	if(BANK_HEADER_LEN + (size_t)n * BANK_ENTRY_LEN > len) return 0;
+
+	for(i=0; i<n; i++) {
+		e = b + BANK_HEADER_LEN + i * BANK_ENTRY_LEN;
+		off = get_u32(e);
+		end = get_u32(e + 4);
+		loop = get_u32(e + 8);
+		if(off > len || end > len - off || end >= (1UL << 20) || loop > end) return 0;
+	}
+
+	return 1;
+}
+
+
+static int map_bank(const char *fname)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if(fd == -1 || fstat(fd, &st) != 0) {
+		perror(fname);
+		if(fd != -1) close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) {
+		perror(fname);
+		return -1;
+	}
+
+	if(!bank_valid(p, st.st_size) || !sample_bank(p)) {
+		fprintf(stderr, "%s: not a sample bank, or a sample out of range\n", fname);
+		munmap(p, st.st_size);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-a algo] [-b] [-d style] [-f tick] [-i instr] [-k kernel] [-r] [-s bank] [-t] [-o output] [tune]\n", prog);
+	fprintf(stderr, "  -a NUM   FM operator algorithm NUM of the instrument, 0..%d\n", NUM_FM_ALGOS - 1);
+	fprintf(stderr, "  -b       benchmark with all oscillators playing\n");
+	fprintf(stderr, "  -d NUM   play rhythm NUM along, 0..%d\n", NUM_RHYTHMS - 1);
+	fprintf(stderr, "  -f TICK  play the tune from sequencer tick TICK\n");
+	fprintf(stderr, "  -i NUM   play instrument NUM, 0..%d, %d is the FM piano\n", NUM_INSTRS - 1, INSTR_PIANO);
+	fprintf(stderr, "  -k NAME  FM mixing kernel: c, mul, avx2 or lerp (interpolating)\n");
+	fprintf(stderr, "  -o FILE  write audio to FILE, '-' for stdout\n");
+	fprintf(stderr, "  -r       write raw 16 bit PCM instead of WAV\n");
+	fprintf(stderr, "  -s FILE  map sample bank FILE instead of the built in bank\n");
+	fprintf(stderr, "  -t       run the audio ISR on the emulated timers\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *fname = NULL;
+	int raw = 0;
+	int timers = 0;
+	const char *kernel = NULL;
+	const char *bank = NULL;
+	int instr = INSTR_PIANO;
+	int algo = -1;
+	int style = RHYTHM_OFF;
+	int from = 0;
+	int benchmark = 0;
+	int c, i;
+	double t1, t2, ns;
+
+	while((c = getopt(argc, argv, "a:bd:f:i:k:o:rs:th")) != -1) {
+		switch(c) {
+			case 'a':
+				algo = atoi(optarg);
+				break;
+			case 'b':
+				benchmark = 1;
+				break;
+			case 'd':
+				style = atoi(optarg);
+				break;
+			case 'f':
+				from = atoi(optarg);
+				break;
+			case 'i':
+				instr = atoi(optarg);
+				break;
+			case 's':
+				bank = optarg;
+				break;
+			case 'o':
+				fname = optarg;
+				break;
+			case 'r':
+				raw = 1;
+				break;
+			case 'k':
+				kernel = optarg;
+				break;
+			case 't':
+				timers = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	audio_init();
+	seq_init();
+	if(bank && map_bank(bank) != 0) return 1;
+	set_instr(instr);
+	if(algo >= 0) osc_set_algo(algo);
+	rhythm_set(style);
+	if(kernel) {
+		if(!strcmp(kernel, "c")) {
+			fm_mix = fm_mix_c;
+		} else if(!strcmp(kernel, "mul")) {
+			fm_mix = fm_mix_mul;
+		} else if(!strcmp(kernel, "avx2") && fm_init_avx2()) {
+			fm_mix = fm_mix_avx2;
+		} else if(!strcmp(kernel, "lerp")) {
+			fm_mix = fm_mix_lerp;
+		} else {
+			fprintf(stderr, "unsupported kernel %s\n", kernel);
+			return 1;
+		}
+	}
+
+	if(optind < argc) {
+		if(load_tune(argv[optind]) != 0) return 1;
+	}
+	if(from) seq_seek(from);
+
+	if(fname) {
+		fout = strcmp(fname, "-") ? fopen(fname, "wb") : stdout;
+		if(fout == NULL) {
+			perror(fname);
+			return 1;
+		}
+		if(!raw) write_wav_header(0);
+	}
+
+	t1 = now();
+	if(benchmark) {
+		/* Hold a note on every oscillator to measure the cost per voice.
+		 * There can be more oscs than queued commands, so each note is
+		 * applied before the next */
+		for(i=0; i<NUM_OSCS; i++) {
+			note_on(24 + i % 72);
+			render_block(NULL, 0);
+		}
+		render(BENCH);
+	} else if(timers) {
+		seq_cmd(SEQ_CMD_PLAY);
+		while(seq_playing()) hal_run(CHUNK * CYCLES_PER_SAMPLE, pwm);
+		hal_run(TAIL * CYCLES_PER_SAMPLE, pwm);
+	} else {
+		seq_cmd(SEQ_CMD_PLAY);
+		while(seq_playing()) render(CHUNK);
+		render(TAIL);
+	}
+	t2 = now();
+
+	flush();
+
+	if(fout) {
+		if(!raw && fseek(fout, 0, SEEK_SET) == 0) write_wav_header(samples);
+		if(fout != stdout) fclose(fout);
+	}
+
+	ns = (t2 - t1) * 1e9 / samples;
+	fprintf(stderr, "%u samples (%.1f s audio) in %.3f s, %.1f ns/sample\n",
+			samples, (double)samples / SRATE, t2 - t1, ns);
+
+	if(benchmark) {
+		fprintf(stderr, "%d voices, %.2f ns/voice/sample, %.0f voices/core\n",
+				NUM_OSCS, ns / NUM_OSCS, 1e9 / SRATE / (ns / NUM_OSCS));
+	}
+
+	return 0;
+}
+
+
+/*
+ * End
+ */
+
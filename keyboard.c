@@ -3,10 +3,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <avr/io.h>
-#include <util/delay.h>
-#include <avr/interrupt.h>
 
+#include "hal.h"
 #include "keyboard.h"
 
 extern void handle_key(uint8_t keynum, uint8_t state);
@@ -36,6 +36,14 @@ enum key {
 #define KEY_FM_MUL KEY_16BEAT
 #define KEY_FM_MOD KEY_WALTZ
 
+/* KEY_POPS, KEY_DISCO, KEY_SWING and KEY_SLOW_ROCK start and stop their
+ * rhythm */
+
+/* The instrument keys, KEY_CLARINET .. KEY_HARPISCORD, are the sequencer
+ * keys below, and select the instrument while KEY_SHIFT is held */
+
+#define KEY_SHIFT KEY_STOP
+
 #define KEY_METRONOME_3_4 KEY_CLARINET
 #define KEY_METRONOME_4_4 KEY_ELECTRIC_GUITAR
 #define KEY_DEL KEY_VIOLIN
@@ -3,22 +3,22 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <avr/io.h>
-#include <util/delay.h>
-#include <avr/interrupt.h>
 
+#include "hal.h"
 #include "keyboard.h"
 #include "audio.h"
 #include "seq.h"
+#include "rhythm.h"
 
 static uint8_t master_vol = 0;
 static int8_t oct = 0;
-static uint8_t fm_mul = 4;
-static uint8_t fm_mod = 3;
+static uint8_t shift = 0;
 
 void handle_key(uint8_t key, uint8_t state)
 {
 	uint8_t note;
+	uint8_t fm_mul, fm_mod;
+	uint8_t style;
 
 	/* Notes */
 
@@ -30,6 +30,19 @@ void handle_key(uint8_t key, uint8_t state)
 		return;
 	}
 
+	/* With the shift key held the instrument keys select the instrument,
+	 * otherwise they are the sequencer keys */
+
+	if(key == KEY_SHIFT) shift = state;
+
+	if(key >= KEY_CLARINET && key <= KEY_HARPISCORD && shift) {
+		if(state) {
+			bip(3);
+			set_instr(INSTR_CLARINET + key - KEY_CLARINET);
+		}
+		return;
+	}
+
 	/* Control keys */
 
 	if(state) {
@@ -68,9 +81,20 @@ void handle_key(uint8_t key, uint8_t state)
 
 			case KEY_STOP:
 				seq_cmd(SEQ_CMD_STOP);
+				rhythm_set(RHYTHM_OFF);
 				all_off();
 				break;
 
+			case KEY_POPS:
+			case KEY_DISCO:
+			case KEY_SWING:
+			case KEY_SLOW_ROCK:
+				style = key == KEY_POPS ? RHYTHM_POPS :
+					key == KEY_DISCO ? RHYTHM_DISCO :
+					key == KEY_SWING ? RHYTHM_SWING : RHYTHM_SLOW_ROCK;
+				rhythm_set(rhythm_get() == style ? RHYTHM_OFF : style);
+				break;
+
 			case KEY_FIRST:
 				seq_cmd(SEQ_CMD_FIRST);
 				break;
@@ -116,12 +140,16 @@ void handle_key(uint8_t key, uint8_t state)
 				break;
 
 			case KEY_FM_MUL:
+				osc_get_fm(&fm_mul, &fm_mod);
 				fm_mul = fm_mul + 1;
 				if(fm_mul == 8) fm_mul = 1;
+				osc_set_fm(fm_mul, fm_mod);
 				break;
 			
 			case KEY_FM_MOD:
+				osc_get_fm(&fm_mul, &fm_mod);
 				fm_mod = (fm_mod + 1) % 7;
+				osc_set_fm(fm_mul, fm_mod);
 				break;
 		}
 
@@ -133,10 +161,6 @@ void handle_key(uint8_t key, uint8_t state)
 				break;
 		}
 	}
-
-
-				
-	osc_set_fm(fm_mul, fm_mod);
 }
 
 
@@ -150,8 +174,10 @@ int main(void)
 	audio_init();
 	seq_init();
 	sei();
-	
-	osc_set_fm(fm_mul, fm_mod);
+
+#ifdef AUTOPLAY
+	seq_cmd(SEQ_CMD_PLAY);
+#endif
 				
 	for(;;) {
 		keyboard_scan();
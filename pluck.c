@@ -0,0 +1,166 @@
+
+/*
+ * Karplus-Strong plucked strings. A voice costs a load, an add, a shift and a
+ * store per sample, plus the 8x8 velocity multiply, against the two table
+ * lookups and two multiplies of an FM voice; it pays for it in RAM. The lines
+ * hold 16 bit values: with 8 bits the rounding of the average either drains
+ * the high notes within a few periods or leaves them ringing forever.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hal.h"
+#include "audio.h"
+#include "tables.h"
+#include "pluck.h"
+
+#define POOL_LEN (KS_POOL / 2)
+#define MIN_LEN 4
+#define PLUCK_LEVEL (63 << 7)	/* Noise level */
+#define LFSR_TAPS 0xb400
+
+/*
+ * Delay line segments in the pool, one per osc, len 0 when free. A pool of
+ * fewer than 256 values takes byte offsets
+ */
+
+#if POOL_LEN < 256
+typedef uint8_t seg_t;
+#else
+typedef uint16_t seg_t;
+#endif
+
+struct segment {
+	seg_t start;
+	seg_t len;
+};
+
+static int16_t pool[POOL_LEN];
+static struct segment seg[NUM_OSCS];
+static uint16_t lfsr = 0x1d2b;
+
+
+void pluck_free(uint8_t id)
+{
+	seg[id].len = 0;
+}
+
+
+/*
+ * First fit: the free space starts at the start of the pool or at the end of
+ * a segment. Returns the start of a free run of len values, or POOL_LEN
+ */
+
+static uint16_t seg_alloc(uint16_t len)
+{
+	uint16_t start;
+	uint8_t i, k;
+
+	for(i=0; i<=NUM_OSCS; i++) {
+		if(i < NUM_OSCS) {
+			if(seg[i].len == 0) continue;
+			start = seg[i].start + seg[i].len;
+		} else {
+			start = 0;
+		}
+		if(start + len > POOL_LEN) continue;
+
+		for(k=0; k<NUM_OSCS; k++) {
+			if(seg[k].len && start < seg[k].start + seg[k].len && seg[k].start < start + len) break;
+		}
+		if(k == NUM_OSCS) return start;
+	}
+
+	return POOL_LEN;
+}
+
+
+/*
+ * Pluck the string of osc id at the note with the given phase step. Averaging
+ * the oldest two values makes the loop half a sample shorter than the line,
+ * so the line is one period rounded up. Returns 0 if there is no room for it
+ * in the pool
+ */
+
+uint8_t pluck_start(struct pluck_voice *v, uint8_t id, phase_t step, uint8_t bridge)
+{
+	uint32_t len = ((1UL << (PHASE_BITS - 1)) * 2 - 1) / step + 1;
+	uint16_t start, j;
+	int32_t sum = 0;
+
+	pluck_free(id);
+	if(len < MIN_LEN) len = MIN_LEN;
+	if(len > POOL_LEN) return 0;
+
+	start = seg_alloc(len);
+	if(start == POOL_LEN) return 0;
+	seg[id].start = start;
+	seg[id].len = len;
+
+	v->line = pool + start;
+	v->len = len;
+	v->pos = 0;
+
+	for(j=0; j<len; j++) {
+		lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & LFSR_TAPS);
+		v->line[j] = (lfsr & 1) ? PLUCK_LEVEL : -PLUCK_LEVEL;
+	}
+
+	/* Plucking at 1/2^bridge of the string from the bridge cancels every
+	 * 2^bridge'th harmonic, which a comb filter on the noise does */
+
+	if(bridge) {
+		uint16_t d = len >> bridge;
+		if(d == 0) d = 1;
+		for(j=len; j-- > d; ) v->line[j] = (v->line[j] - v->line[j - d]) / 2;
+	}
+
+	/* The average passes DC unchanged, so any offset would stay forever.
+	 * Values now stay within twice PLUCK_LEVEL: the sum of two fits in 16
+	 * bits and a value in 8 bits after the shift in pluck_mix() */
+
+	for(j=0; j<len; j++) sum += v->line[j];
+	sum /= (int16_t)len;
+	for(j=0; j<len; j++) v->line[j] -= sum;
+
+	return 1;
+}
+
+
+/*
+ * Mix n samples of voice v into out[]. The newer of the two values averaged
+ * is the older one of the next sample, so each sample loads one value
+ */
+
+void pluck_mix(int16_t *out, uint16_t n, struct pluck_voice *v)
+{
+	int16_t *line = v->line;
+	uint16_t len = v->len;
+	uint16_t pos = v->pos;
+	uint16_t vel = v->vel;
+	int16_t dvel = v->dvel;
+	int16_t a = line[pos];
+	uint16_t j;
+
+	for(j=0; j<n; j++) {
+		uint16_t next = pos + 1 == len ? 0 : pos + 1;
+		int16_t b = line[next];
+		int16_t p = (int8_t)(a >> 7) * (uint8_t)(vel >> 8);
+
+		line[pos] = (a + b) >> 1;
+		out[j] += p < 0 ? -(int16_t)MIX_SCALE(-p) : (int16_t)MIX_SCALE(p);
+		vel += dvel;
+		a = b;
+		pos = next;
+	}
+
+	v->pos = pos;
+	v->vel = vel;
+}
+
+
+/*
+ * End
+ */
+
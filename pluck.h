@@ -0,0 +1,27 @@
+#ifndef pluck_h
+#define pluck_h
+
+/*
+ * Karplus-Strong plucked string voices. Each voice owns a delay line one
+ * period of its note long, carved from a pool of KS_POOL bytes shared by all
+ * voices. The line is filled with noise at the pluck, and every sample the
+ * string averages two neighbouring values back into the line.
+ */
+
+#ifndef KS_POOL
+#define KS_POOL 96		/* Bytes of delay lines for all pluck voices */
+#endif
+
+struct pluck_voice {
+	int16_t *line;		/* Delay line in the pool */
+	uint16_t len;		/* Length of the delay line */
+	uint16_t pos;		/* Read and write position */
+	uint16_t vel;		/* Velocity, Q8.8 */
+	int16_t dvel;		/* Velocity increment per sample, Q8.8 */
+};
+
+uint8_t pluck_start(struct pluck_voice *v, uint8_t id, phase_t step, uint8_t bridge);
+void pluck_free(uint8_t id);
+void pluck_mix(int16_t *out, uint16_t n, struct pluck_voice *v);
+
+#endif
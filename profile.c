@@ -0,0 +1,201 @@
+
+/*
+ * Cycle accurate profiler: runs the firmware in simavr and reports the cycles
+ * spent in the interrupt handlers, and in render_block() which is bracketed
+ * by the PB0 probe. Nested interrupts are subtracted from the handler they
+ * interrupted, so every cycle is counted once.
+ *
+ * usage: avr-profile firmware.elf [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "sim_interrupts.h"
+#include "avr_ioport.h"
+
+#define MCU "atmega644"
+#define FREQ 16000000
+#ifndef SRATE
+#define SRATE 15625
+#endif
+#define CYCLES_PER_SAMPLE (FREQ / SRATE)
+#define MAX_DEPTH 8
+
+struct cyc_stat {
+	const char *name;
+	uint64_t n;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+/* Vector numbers of the ATmega644. Timer 1 overflow was the sample clock
+ * before timer 2, it is counted so older firmware can be compared */
+
+struct vec {
+	uint8_t num;
+	struct cyc_stat stat;
+};
+
+static struct vec vecs[] = {
+	{ 9, { "TIMER2_COMPA_vect" } },
+	{ 15, { "TIMER1_OVF_vect" } },
+};
+
+#define NUM_VECS (sizeof vecs / sizeof vecs[0])
+
+static struct cyc_stat render = { "render_block (PB0)" };
+
+/* Stack of running handlers, for nesting */
+
+static struct {
+	uint64_t start;
+	uint64_t nested;
+} stack[MAX_DEPTH];
+
+static int depth = 0;
+static uint64_t probe_start;
+static uint64_t probe_nested;
+static int probe_on = 0;
+static avr_t *avr;
+
+
+static void stat_add(struct cyc_stat *s, uint64_t v)
+{
+	if(s->n == 0 || v < s->min) s->min = v;
+	if(v > s->max) s->max = v;
+	s->sum += v;
+	s->n ++;
+}
+
+
+static void stat_print(struct cyc_stat *s)
+{
+	printf("%-20s %10llu %8llu %8.1f %8llu\n", s->name,
+			(unsigned long long)s->n,
+			(unsigned long long)s->min,
+			s->n ? (double)s->sum / s->n : 0.0,
+			(unsigned long long)s->max);
+}
+
+
+/*
+ * Called with value 1 when the vector starts running and 0 at its reti
+ */
+
+static void on_vector(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	struct vec *v = param;
+	uint64_t incl, excl;
+
+	if(value) {
+		if(depth == MAX_DEPTH) {
+			fprintf(stderr, "interrupts nested too deep\n");
+			exit(1);
+		}
+		stack[depth].start = avr->cycle;
+		stack[depth].nested = 0;
+		depth ++;
+	} else if(depth > 0) {
+		depth --;
+		incl = avr->cycle - stack[depth].start;
+		excl = incl - stack[depth].nested;
+		stat_add(&v->stat, excl);
+		if(depth > 0) stack[depth-1].nested += incl;
+		if(probe_on) probe_nested += incl;
+	}
+}
+
+
+static void on_probe(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	if(value && !probe_on) {
+		probe_on = 1;
+		probe_start = avr->cycle;
+		probe_nested = 0;
+	}
+	if(!value && probe_on) {
+		probe_on = 0;
+		stat_add(&render, avr->cycle - probe_start - probe_nested);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	elf_firmware_t f;
+	double seconds = 96;
+	uint64_t end;
+	uint64_t busy = 0;
+	uint64_t samples = 0;
+	size_t i;
+	int state;
+
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s firmware.elf [seconds]\n", argv[0]);
+		return 1;
+	}
+	if(argc > 2) seconds = atof(argv[2]);
+
+	memset(&f, 0, sizeof f);
+	if(elf_read_firmware(argv[1], &f) != 0) {
+		fprintf(stderr, "%s: can not read firmware\n", argv[1]);
+		return 1;
+	}
+	if(f.mmcu[0] == '\0') strcpy(f.mmcu, MCU);
+	if(f.frequency == 0) f.frequency = FREQ;
+
+	avr = avr_make_mcu_by_name(f.mmcu);
+	if(avr == NULL) {
+		fprintf(stderr, "unknown mcu %s\n", f.mmcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+
+	for(i=0; i<NUM_VECS; i++) {
+		avr_irq_register_notify(avr_get_interrupt_irq(avr, vecs[i].num) + AVR_INT_IRQ_RUNNING,
+				on_vector, &vecs[i]);
+	}
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0),
+			on_probe, NULL);
+
+	end = seconds * f.frequency;
+	fprintf(stderr, "simulating %.1f s of %s at %u Hz\n", seconds, f.mmcu, f.frequency);
+
+	do {
+		state = avr_run(avr);
+	} while(avr->cycle < end && state != cpu_Done && state != cpu_Crashed);
+
+	if(state == cpu_Crashed) {
+		fprintf(stderr, "firmware crashed at cycle %llu\n", (unsigned long long)avr->cycle);
+		return 1;
+	}
+
+	printf("%-20s %10s %8s %8s %8s\n", "cycles", "count", "min", "avg", "max");
+	for(i=0; i<NUM_VECS; i++) {
+		if(vecs[i].stat.n) stat_print(&vecs[i].stat);
+		busy += vecs[i].stat.sum;
+	}
+	stat_print(&render);
+
+	samples = avr->cycle / CYCLES_PER_SAMPLE;
+	printf("\nCPU load in interrupts: %.1f%%, %.1f cycles/sample of %d\n",
+			100.0 * busy / avr->cycle,
+			samples ? (double)busy / samples : 0.0,
+			CYCLES_PER_SAMPLE);
+
+	return 0;
+}
+
+
+/*
+ * End
+ */
+
@@ -0,0 +1,274 @@
+
+/*
+ * Rhythm section. Each style is a one bar pattern per drum, stepped by the
+ * sequencer tick; a drum hit restarts the drum voice from its kit entry. The
+ * voices are mixed after the oscs: noise is a 16 bit LFSR per drum whose low
+ * bit adds or subtracts the level, tones are a sine with a linear pitch
+ * sweep, and both fade out in a linear ramp. Noise costs no multiplies, a
+ * tone one 8x8 multiply per sample, and silent drums cost nothing.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal.h"
+#include "audio.h"
+#include "tables.h"
+#include "rhythm.h"
+#include "seq.h"
+
+#define HZ(f) ((phase_t)((f) * 256.0 * (1UL << (PHASE_BITS - 8)) / SRATE))
+#define RAMP(level, t) ((uint16_t)((level) * 256.0 / ((t) * SRATE)) + 1)
+#define SWEEP(f0, f1, t) ((phase_t)(((f0) - (f1)) * 256.0 * (1UL << (PHASE_BITS - 8)) / SRATE / ((t) * SRATE)) + 1)
+
+#define LFSR_TAPS 0xb400	/* x^16 + x^14 + x^13 + x^11 + 1 */
+
+enum drum_num {
+	DRUM_KICK,
+	DRUM_SNARE,
+	DRUM_HAT,
+	DRUM_OPEN_HAT,
+	NUM_DRUMS
+};
+
+struct drum_kit {
+	phase_t step;		/* Start pitch */
+	phase_t end;		/* End pitch of the sweep */
+	phase_t sweep;		/* Pitch decrement per sample */
+	uint8_t tone;		/* Tone level */
+	uint16_t tdecay;	/* Tone level decrement per sample, Q8.8 */
+	uint8_t noise;		/* Noise level */
+	uint16_t ndecay;	/* Noise level decrement per sample, Q8.8 */
+};
+
+/*
+ * State of a sounding drum. The sweep and decays stay in the kit in flash,
+ * they are read once per block
+ */
+
+struct drum {
+	phase_t off;
+	phase_t step;
+	uint16_t tlevel;	/* Tone level, Q8.8 */
+	uint16_t nlevel;	/* Noise level, Q8.8 */
+	uint16_t lfsr;		/* Noise generator */
+};
+
+/*
+ * Patterns are one bar, bit n of hits is step n. A beat is 60 ticks, so 16
+ * steps of 15 ticks are sixteenths and 12 steps of 20 ticks triplet eighths
+ */
+
+struct pattern {
+	uint8_t steps;		/* Steps per bar */
+	uint8_t step_ticks;	/* Sequencer ticks per step */
+	uint16_t hits[NUM_DRUMS];
+};
+
+static const struct drum_kit kit[NUM_DRUMS] PROGMEM = {
+	[DRUM_KICK] = {
+		.step = HZ(150), .end = HZ(50), .sweep = SWEEP(150, 50, 0.05),
+		.tone = 32, .tdecay = RAMP(32, 0.25),
+	},
+	[DRUM_SNARE] = {
+		.step = HZ(200), .end = HZ(200),
+		.tone = 16, .tdecay = RAMP(16, 0.08),
+		.noise = 20, .ndecay = RAMP(20, 0.15),
+	},
+	[DRUM_HAT] = {
+		.noise = 12, .ndecay = RAMP(12, 0.04),
+	},
+	[DRUM_OPEN_HAT] = {
+		.noise = 10, .ndecay = RAMP(10, 0.25),
+	},
+};
+
+static const struct pattern patterns[NUM_RHYTHMS] PROGMEM = {
+	[RHYTHM_POPS] = {
+		16, 15, {
+			0x0501,		/* x.......x.x..... */
+			0x1010,		/* ....x.......x... */
+			0x1555,		/* x.x.x.x.x.x.x... */
+			0x4000,		/* ..............x. */
+		},
+	},
+	[RHYTHM_DISCO] = {
+		16, 15, {
+			0x1111,		/* x...x...x...x... */
+			0x1010,		/* ....x.......x... */
+			0x1111,		/* x...x...x...x... */
+			0x4444,		/* ..x...x...x...x. */
+		},
+	},
+	[RHYTHM_SWING] = {
+		12, 20, {
+			0x0041,		/* x.....x..... */
+			0x0208,		/* ...x.....x.. */
+			0x0a69,		/* x..x.xx..x.x */
+			0x0000,
+		},
+	},
+	[RHYTHM_SLOW_ROCK] = {
+		12, 20, {
+			0x0141,		/* x.....x.x... */
+			0x0208,		/* ...x.....x.. */
+			0x0fff,		/* xxxxxxxxxxxx */
+			0x0000,
+		},
+	},
+};
+
+static volatile uint8_t style = RHYTHM_OFF;
+static uint8_t pos;			/* Step in the bar */
+static uint8_t wait;			/* Ticks until the next step */
+static struct drum drums[NUM_DRUMS];
+
+
+/*
+ * Start playing a style from the top of the bar, or stop with RHYTHM_OFF.
+ * Drums already sounding ring out
+ */
+
+void rhythm_set(uint8_t s)
+{
+	if(s >= NUM_RHYTHMS) s = RHYTHM_OFF;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		style = s;
+		pos = 0;
+		wait = 0;
+	}
+	seq_changed = 1;
+}
+
+
+uint8_t rhythm_get(void)
+{
+	return style;
+}
+
+
+static void drum_start(uint8_t n)
+{
+	struct drum_kit k;
+	struct drum *d = &drums[n];
+
+	memcpy_P(&k, &kit[n], sizeof k);
+	d->off = 0;
+	d->step = k.step;
+	d->tlevel = k.tone << 8;
+	d->nlevel = k.noise << 8;
+	if(d->lfsr == 0) d->lfsr = 0xace1 + n;
+}
+
+
+/*
+ * Called on every sequencer tick
+ */
+
+void rhythm_tick(void)
+{
+	uint8_t s = style;
+	uint8_t n;
+
+	if(s == RHYTHM_OFF) return;
+
+	if(wait == 0) {
+		for(n=0; n<NUM_DRUMS; n++) {
+			if(pgm_read_word(&patterns[s].hits[n]) & (1U << pos)) drum_start(n);
+		}
+		if(++pos == pgm_read_byte(&patterns[s].steps)) pos = 0;
+		wait = pgm_read_byte(&patterns[s].step_ticks);
+	}
+	wait --;
+}
+
+
+/*
+ * Ticks before the next step, 0 if it is on the next tick
+ */
+
+uint16_t rhythm_wait(void)
+{
+	return style == RHYTHM_OFF ? 0xffff : wait;
+}
+
+
+/*
+ * Skip ticks without a step. A style started meanwhile steps on the next tick
+ */
+
+void rhythm_skip(uint16_t ticks)
+{
+	if(style == RHYTHM_OFF) return;
+	wait = wait > ticks ? wait - ticks : 0;
+}
+
+
+/*
+ * Add n samples of the sounding drums to out[]. Returns 0 if all drums are
+ * silent
+ */
+
+uint8_t rhythm_mix(int16_t *out, uint16_t n)
+{
+	struct drum_kit k;
+	struct drum *d;
+	uint8_t sounding = 0;
+	uint8_t i;
+	uint16_t j;
+
+	for(i=0; i<NUM_DRUMS; i++) {
+		d = &drums[i];
+
+		if(d->tlevel == 0 && d->nlevel == 0) continue;
+		memcpy_P(&k, &kit[i], sizeof k);
+
+		if(d->tlevel) {
+			phase_t off = d->off;
+			phase_t step = d->step;
+			phase_t sweep = k.sweep;
+			phase_t last = k.end + sweep;
+			uint16_t level = d->tlevel;
+			uint16_t decay = k.tdecay;
+
+			for(j=0; j<n && level; j++) {
+				int8_t s = sin_get(off >> SIN_SHIFT) >> SIN_SCALE;
+				out[j] += (s * (uint8_t)(level >> 8)) >> 7;
+				off += step;
+				if(step >= last) step -= sweep;
+				level = level > decay ? level - decay : 0;
+			}
+
+			d->off = off;
+			d->step = step;
+			d->tlevel = level;
+			sounding = 1;
+		}
+
+		if(d->nlevel) {
+			uint16_t r = d->lfsr;
+			uint16_t level = d->nlevel;
+			uint16_t decay = k.ndecay;
+
+			for(j=0; j<n && level; j++) {
+				r = (r >> 1) ^ (-(r & 1) & LFSR_TAPS);
+				out[j] += (r & 1) ? (level >> 8) : -(level >> 8);
+				level = level > decay ? level - decay : 0;
+			}
+
+			d->lfsr = r;
+			d->nlevel = level;
+			sounding = 1;
+		}
+	}
+
+	return sounding;
+}
+
+
+/*
+ * End
+ */
+
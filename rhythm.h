@@ -0,0 +1,27 @@
+#ifndef rhythm_h
+#define rhythm_h
+
+/*
+ * Rhythm section: drum patterns for the style keys, played on a few drum
+ * voices of LFSR noise and sine tones with falling pitch. The patterns step
+ * on the sequencer tick, so they follow the tempo keys.
+ */
+
+#define RHYTHM_OFF 0xff
+
+enum rhythm_style {
+	RHYTHM_POPS,
+	RHYTHM_DISCO,
+	RHYTHM_SWING,
+	RHYTHM_SLOW_ROCK,
+	NUM_RHYTHMS
+};
+
+void rhythm_set(uint8_t style);
+uint8_t rhythm_get(void);
+void rhythm_tick(void);
+uint16_t rhythm_wait(void);
+void rhythm_skip(uint16_t ticks);
+uint8_t rhythm_mix(int16_t *out, uint16_t n);
+
+#endif
@@ -0,0 +1,149 @@
+
+/*
+ * Sample playback: looks up samples in the sample bank and mixes looped PCM
+ * voices, transposed from the root note of the sample to the played note.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hal.h"
+#include "audio.h"
+#include "tables.h"
+#include "sample.h"
+
+#define FRAC_BITS 12
+
+extern const uint8_t sample_bank_builtin[] PROGMEM;
+
+static const uint8_t *bank = sample_bank_builtin;
+
+
+static uint16_t bank_u16(uint32_t off)
+{
+	return pgm_read_byte(&bank[off]) | (pgm_read_byte(&bank[off + 1]) << 8);
+}
+
+
+static uint32_t bank_u32(uint32_t off)
+{
+	return bank_u16(off) | ((uint32_t)bank_u16(off + 2) << 16);
+}
+
+
+/*
+ * Select the sample bank. Returns 0 and keeps the current bank when the new
+ * one does not start with the bank magic
+ */
+
+uint8_t sample_bank(const uint8_t *b)
+{
+	uint8_t i;
+
+	for(i=0; i<4; i++) {
+		if(pgm_read_byte(&b[i]) != BANK_MAGIC[i]) return 0;
+	}
+	bank = b;
+	return 1;
+}
+
+
+uint8_t sample_count(void)
+{
+	return bank_u16(4);
+}
+
+
+/*
+ * Set up voice v to play sample n at the given note. Returns 0 if there is
+ * no such sample
+ */
+
+uint8_t sample_start(struct sample_voice *v, uint8_t n, uint8_t note)
+{
+	uint32_t e = BANK_HEADER_LEN + (uint32_t)n * BANK_ENTRY_LEN;
+	uint32_t step;
+	int16_t d;
+	int8_t oct;
+
+	if(n >= sample_count()) return 0;
+
+	v->data = (const int8_t *)bank + bank_u32(e);
+	v->loop_end = bank_u32(e + 4) << FRAC_BITS;
+	v->loop_start = bank_u32(e + 8) << FRAC_BITS;
+	v->mode = pgm_read_byte(&bank[e + 12]);
+	v->off = 0;
+	v->rev = 0;
+
+	if(v->loop_start > v->loop_end || v->loop_end - v->loop_start < (16UL << FRAC_BITS)) {
+		v->mode = LOOP_NONE;
+	}
+
+	/* Transpose from the root note, and from the bank rate to ours */
+
+	d = note - pgm_read_byte(&bank[e + 13]) + 132;
+	oct = d / 12 - 11;
+	step = (uint32_t)pgm_read_word(&semitab[d % 12]) * bank_u16(6) / SRATE;
+	step = oct >= 0 ? step << oct : step >> -oct;
+	v->step = step < 0xffff ? step : 0xffff;
+
+	return 1;
+}
+
+
+/*
+ * Mix n samples of voice v into out[]. Returns 0 when a sample without loop
+ * has played to its end. Loops are at least as long as the largest step, so
+ * a wrap or turn always lands inside the loop
+ */
+
+uint8_t sample_mix(int16_t *out, uint16_t n, struct sample_voice *v)
+{
+	uint32_t off = v->off;
+	uint32_t start = v->loop_start;
+	uint32_t end = v->loop_end;
+	uint16_t step = v->step;
+	uint16_t vel = v->vel;
+	int16_t p;
+	uint16_t j;
+
+	for(j=0; j<n; j++) {
+
+		if(off >= end) {
+			if(v->mode == LOOP_FORWARD) {
+				off -= end - start;
+			} else if(v->mode == LOOP_REVERSE) {
+				off = 2 * end - off - 1;
+				if(off < start) off = start;
+				v->rev = 1;
+			} else {
+				v->off = off;
+				return 0;
+			}
+		}
+
+		p = (int8_t)pgm_read_byte(&v->data[off >> FRAC_BITS]) * (uint8_t)(vel >> 8);
+		out[j] += p < 0 ? -(int16_t)MIX_SCALE(-p) : (int16_t)MIX_SCALE(p);
+		vel += v->dvel;
+
+		if(!v->rev) {
+			off += step;
+		} else if(off - start >= step) {
+			off -= step;
+		} else {
+			off = 2 * start + step - off;
+			if(off >= end) off = end - 1;
+			v->rev = 0;
+		}
+	}
+
+	v->off = off;
+	v->vel = vel;
+	return 1;
+}
+
+
+/*
+ * End
+ */
+
@@ -0,0 +1,48 @@
+#ifndef sample_h
+#define sample_h
+
+/*
+ * Sample playback voices. A sample bank is a block of flash, or on the host a
+ * file mapped into memory, holding a header, a table of samples and their 8
+ * bit signed PCM data. All numbers are little endian:
+ *
+ *   0   "PSB1"
+ *   4   uint16 number of samples
+ *   6   uint16 sample rate in Hz
+ *   8   one 16 byte entry per sample:
+ *         uint32 offset of the PCM data from the start of the bank
+ *         uint32 length, the end of the loop
+ *         uint32 start of the loop
+ *         uint8 loop mode
+ *         uint8 root note, the note the sample plays at without transposing
+ *         uint16 reserved
+ */
+
+#define BANK_MAGIC "PSB1"
+#define BANK_HEADER_LEN 8
+#define BANK_ENTRY_LEN 16
+
+enum sample_loop {
+	LOOP_NONE,		/* Play once */
+	LOOP_FORWARD,		/* Jump back to the loop start at the end */
+	LOOP_REVERSE,		/* Play the loop back and forth */
+};
+
+struct sample_voice {
+	uint32_t off;		/* Position, Q20.12 */
+	uint32_t loop_end;	/* End of the loop, Q20.12 */
+	uint32_t loop_start;	/* Start of the loop, Q20.12 */
+	const int8_t *data;	/* PCM data */
+	uint16_t step;		/* Step size, Q4.12 */
+	uint8_t mode;		/* Loop mode */
+	uint8_t rev;		/* Playing the loop backwards */
+	uint16_t vel;		/* Velocity, Q8.8 */
+	int16_t dvel;		/* Velocity increment per sample, Q8.8 */
+};
+
+uint8_t sample_bank(const uint8_t *bank);
+uint8_t sample_count(void);
+uint8_t sample_start(struct sample_voice *v, uint8_t n, uint8_t note);
+uint8_t sample_mix(int16_t *out, uint16_t n, struct sample_voice *v);
+
+#endif
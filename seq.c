@@ -2,12 +2,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <util/delay.h>
 
+#include "hal.h"
 #include "audio.h"
 #include "seq.h"
+#include "rhythm.h"
 
 #define BIP_ALERT 50
+#define TEMPO_SRATE 15625L	/* seq_tempo is in samples per tick at this rate */
 
 enum seq_state {
 	SEQ_STATE_IDLE,
@@ -37,23 +39,233 @@ volatile struct seq seq_list[] = {
 volatile struct seq *seq_play;	/* Current play pointer */
 volatile struct seq *seq_rec;	/* Current rec pointer */
 volatile struct seq *seq_last;	/* Last note in recording */
+volatile uint8_t seq_changed;	/* Set when the schedule is to be redone */
+
+/*
+ * Positions of the note on events in the list, so navigation finds the
+ * previous or next note by binary search instead of walking the list. Two
+ * bytes per event is more RAM than the AVR has left, there the list is
+ * walked
+ */
+
+#ifdef SEQ_INDEX
+static uint16_t seq_ons[SEQ_NOTES];
+static uint16_t seq_ons_len;
+#endif
+
+/*
+ * Notes held before every SEQ_SNAP'th event, one bit per note, so a seek
+ * finds the held notes by replaying at most SEQ_SNAP events instead of the
+ * list up to the new position. Without SEQ_SNAP the list is replayed from
+ * the start. seq_goto() leaves the held notes in seq_held, and they start
+ * if the first tick played is still at restore_at
+ */
+
+#define HELD_BYTES (128 / 8)
+
+#ifdef SEQ_SNAP
+static uint8_t seq_snaps[(SEQ_NOTES - 1) / SEQ_SNAP + 1][HELD_BYTES];
+#endif
+static uint8_t seq_held[HELD_BYTES];
+static volatile struct seq *restore_at;
+
+/*
+ * The renderer only wakes the sequencer for ticks with something to do. The
+ * ticks in between are skipped, and accounted for at the next wake
+ */
+
+static uint16_t tick_len = 1;	/* Samples per tick */
+static uint16_t planned = 1;	/* Ticks from the last tick run to the next */
+static uint16_t tick_base;	/* seq_ticks after the last tick run */
+static uint8_t counting;	/* seq_ticks was counting at the last tick run */
+
+
+/*
+ * Swap the neighbouring runs [a, m) and [m, b) of the list by three reversals
+ */
+
+static void seq_reverse(struct seq *l, uint16_t a, uint16_t b)
+{
+	struct seq e;
+
+	while(a + 1 < b) {
+		e = l[a];
+		l[a++] = l[--b];
+		l[b] = e;
+	}
+}
+
+
+static void seq_rotate(struct seq *l, uint16_t a, uint16_t m, uint16_t b)
+{
+	seq_reverse(l, a, m);
+	seq_reverse(l, m, b);
+	seq_reverse(l, a, b);
+}
+
+
+/*
+ * Merge the events recorded at [m, n) into the sorted list before them. The
+ * recording is in time order unless the play position was moved meanwhile,
+ * so an insertion pass, one compare per event when it already is, puts it in
+ * order first. Events before the first recorded one stay in place; the
+ * smaller of the two runs behind it is moved to the free end of the list and
+ * merged back, moving every event once. Recorded events go after existing
+ * ones at the same tick. Only a nearly full list falls back to rotating runs
+ * of recorded events into place
+ */
+
+static void seq_merge(uint16_t m, uint16_t n)
+{
+	struct seq *l = (struct seq *)seq_list;
+	struct seq e;
+	uint16_t i, j, k, w, p;
+	uint16_t free = SEQ_NOTES - n;
+
+	for(i=m+1; i<n; i++) {
+		e = l[i];
+		for(j=i; j>m && l[j-1].ticks > e.ticks; j--) l[j] = l[j-1];
+		l[j] = e;
+	}
+
+	if(m == n) return;
+	p = m;
+	while(p > 0 && l[p-1].ticks > l[m].ticks) p--;
+	if(p == m) return;
+
+	if(m - p <= free) {
+
+		/* Existing events out of the way, merge forwards */
+
+		memcpy(l + n, l + p, (m - p) * sizeof *l);
+		i = n;
+		j = m;
+		w = p;
+		while(i < n + m - p && j < n) l[w++] = l[j].ticks < l[i].ticks ? l[j++] : l[i++];
+		while(i < n + m - p) l[w++] = l[i++];
+
+	} else if(n - m <= free) {
+
+		/* Recorded events out of the way, merge backwards */
+
+		memcpy(l + n, l + m, (n - m) * sizeof *l);
+		i = m;
+		j = n + n - m;
+		w = n;
+		while(i > p && j > n) l[--w] = l[i-1].ticks > l[j-1].ticks ? l[--i] : l[--j];
+		while(j > n) l[--w] = l[--j];
+
+	} else {
+		i = p;
+		j = m;
+		while(j < n) {
+			while(i < j && l[i].ticks <= l[j].ticks) i++;
+			if(i == j) break;
+			k = j;
+			while(k < n && l[k].ticks < l[i].ticks) k++;
+			seq_rotate(l, i, j, k);
+			i += k - j;
+			j = k;
+		}
+	}
+}
+
+
+/*
+ * Set held[] to the notes held before the event at position p
+ */
+
+static void held_at(uint16_t p, uint8_t *held)
+{
+	uint16_t i = 0;
+	uint8_t note;
+
+	/* The first snapshot is never written and holds no notes */
+
+#ifdef SEQ_SNAP
+	if(p > 0) i = (p - 1) / SEQ_SNAP * SEQ_SNAP;
+	memcpy(held, seq_snaps[i / SEQ_SNAP], HELD_BYTES);
+#else
+	memset(held, 0, HELD_BYTES);
+#endif
+
+	for(; i<p; i++) {
+		note = seq_list[i].note;
+		if(note & 0x80) {
+			held[(note & 0x7f) >> 3] |= 1 << (note & 7);
+		} else {
+			held[note >> 3] &= ~(1 << (note & 7));
+		}
+	}
+}
 
 
-static int seq_cmp(const void *a, const void *b)
+/*
+ * Rebuild the note on index and the held note snapshots after the list
+ * changed
+ */
+
+static void index_build(void)
+{
+#ifdef SEQ_INDEX
+	uint16_t i;
+
+	seq_ons_len = 0;
+	for(i=0; seq_list + i < seq_last; i++) {
+		if(seq_list[i].note & 0x80) seq_ons[seq_ons_len++] = i;
+	}
+#endif
+#ifdef SEQ_SNAP
+	uint16_t p;
+
+	for(p=SEQ_SNAP; seq_list + p < seq_last; p+=SEQ_SNAP) {
+		held_at(p, seq_snaps[p / SEQ_SNAP]);
+	}
+#endif
+	restore_at = NULL;
+}
+
+
+/*
+ * Position of the first note on at or after p, or the end of the list
+ */
+
+static uint16_t next_on(uint16_t p)
 {
-	const struct seq *seq_a = a;
-	const struct seq *seq_b = b;
-	if (seq_a->ticks > seq_b->ticks) return +1;
-	if (seq_a->ticks < seq_b->ticks) return -1;
-	return 0;
+	uint16_t n = seq_last - seq_list;
+#ifdef SEQ_INDEX
+	uint16_t lo = 0, hi = seq_ons_len, mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(seq_ons[mid] < p) lo = mid + 1; else hi = mid;
+	}
+	return lo < seq_ons_len ? seq_ons[lo] : n;
+#else
+	while(p < n && !(seq_list[p].note & 0x80)) p++;
+	return p;
+#endif
 }
 
 
-static void seq_sort(void)
+/*
+ * Position of the last note on at or before p, or the start of the list
+ */
+
+static uint16_t prev_on(uint16_t p)
 {
-	uint16_t size = sizeof *seq_list;
-	uint16_t nmemb = seq_last - seq_list;
-	qsort((void *)seq_list, nmemb, size, seq_cmp);
+#ifdef SEQ_INDEX
+	uint16_t lo = 0, hi = seq_ons_len, mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(seq_ons[mid] <= p) lo = mid + 1; else hi = mid;
+	}
+	return lo > 0 ? seq_ons[lo - 1] : 0;
+#else
+	while(p > 0 && !(seq_list[p].note & 0x80)) p--;
+	return p;
+#endif
 }
 
 
@@ -64,6 +276,8 @@ void seq_init(void)
 	seq_last = seq_list + SEQ_NOTES;
 	seq_ticks = 0;
 	seq_state = SEQ_STATE_IDLE;
+	seq_changed = 1;
+	index_build();
 }
 
 
@@ -84,6 +298,75 @@ void seq_note(uint8_t note, uint8_t state)
 }
 
 
+/*
+ * Append event to the end of the list, used for loading tunes. Events must be
+ * added in time order. Returns 0 when the list is full or out of order
+ */
+
+uint8_t seq_append(uint16_t ticks, uint8_t note)
+{
+	uint16_t p = seq_last - seq_list;
+
+	if(p >= SEQ_NOTES) return 0;
+	if(p > 0 && ticks < (seq_last-1)->ticks) return 0;
+#ifdef SEQ_SNAP
+	if(p > 0 && p % SEQ_SNAP == 0) held_at(p, seq_snaps[p / SEQ_SNAP]);
+#endif
+	seq_last->ticks = ticks;
+	seq_last->note = note;
+#ifdef SEQ_INDEX
+	if(note & 0x80) seq_ons[seq_ons_len++] = p;
+#endif
+	seq_last ++;
+	return 1;
+}
+
+
+/*
+ * Move the play position to event p and the sequencer time to ticks. Every
+ * change of the play position goes through here, so the notes held before p
+ * start when playing from there
+ */
+
+static void seq_goto(uint16_t p, uint16_t ticks)
+{
+	uint8_t held[HELD_BYTES];
+
+	held_at(p, held);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(seq_held, held, HELD_BYTES);
+		seq_play = seq_list + p;
+		restore_at = p ? seq_play : NULL;
+		seq_ticks = ticks;
+	}
+	seq_changed = 1;
+}
+
+
+/*
+ * Move the play position to the first event at or after ticks, found by
+ * binary search in the sorted list, and the sequencer time to ticks
+ */
+
+void seq_seek(uint16_t ticks)
+{
+	uint16_t lo = 0, hi = seq_last - seq_list, mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(seq_list[mid].ticks < ticks) lo = mid + 1; else hi = mid;
+	}
+	seq_goto(lo, ticks);
+}
+
+
+uint8_t seq_playing(void)
+{
+	return seq_state == SEQ_STATE_PLAY;
+}
+
+
 void play_one(uint8_t note)
 {
 	uint8_t i;
@@ -95,12 +378,16 @@ void play_one(uint8_t note)
 
 static void do_stop(void)
 {
-	if(seq_state == SEQ_STATE_REC) {
-		seq_last = seq_rec;
-		seq_sort();
-	}
+	uint8_t rec = seq_state == SEQ_STATE_REC;
+
 	seq_state = SEQ_STATE_IDLE;
 	seq_metro = 0;
+
+	if(rec) {
+		seq_merge(seq_last - seq_list, seq_rec - seq_list);
+		seq_last = seq_rec;
+		index_build();
+	}
 }
 
 
@@ -110,30 +397,29 @@ static void do_stop(void)
 
 void seq_cmd(enum seq_cmd cmd)
 {
+	uint16_t p;
 
 	switch(cmd) {
 
 		case SEQ_CMD_CLEAR:
-			seq_play = seq_list;
 			seq_rec = seq_list;
 			seq_last = seq_list;
 			memset((void *)seq_list, 0, sizeof seq_list);
-			seq_ticks = 0;
+			index_build();
+			seq_goto(0, 0);
 			break;
 			
 		case SEQ_CMD_DEL:
-			if(seq_play != seq_list) {
-				seq_play->note = 0;
-				seq_play->ticks = 0;
+			if(seq_play != seq_list && seq_play < seq_last) {
+				memmove((void *)seq_play, (void *)(seq_play + 1), (seq_last - seq_play - 1) * sizeof *seq_list);
 				seq_last --;
-				seq_sort();
+				index_build();
 			} else {
 				bip(BIP_ALERT);
 			}
 
 		case SEQ_CMD_FIRST:
-			seq_play = seq_list;
-			seq_ticks = 0;
+			seq_goto(0, 0);
 			seq_metro = 0;
 			if(seq_last != seq_list) {
 				play_one(seq_play->note);
@@ -143,10 +429,9 @@ void seq_cmd(enum seq_cmd cmd)
 			break;
 
 		case SEQ_CMD_LAST:
-			seq_play = seq_last;
+			p = prev_on(seq_last > seq_list ? seq_last - seq_list - 1 : 0);
+			seq_goto(p, seq_list[p].ticks);
 			seq_metro = 0;
-			while(!(seq_play->note & 0x80) && seq_play > seq_list) seq_play --;
-			seq_ticks = seq_last->ticks;
 			if(seq_play != seq_list) {
 				play_one(seq_play->note);
 			} else {
@@ -155,18 +440,21 @@ void seq_cmd(enum seq_cmd cmd)
 			break;
 
 		case SEQ_CMD_PREV:
-			if(seq_play > seq_list) seq_play --;
-			while(seq_play > seq_list && !(seq_play->note & 0x80)) seq_play --;
+			p = prev_on(seq_play > seq_list ? seq_play - seq_list - 1 : 0);
+			seq_goto(p, seq_list[p].ticks);
 			play_one(seq_play->note);
-			seq_ticks = seq_play->ticks;
 			seq_metro = 0;
 			break;
 
 		case SEQ_CMD_NEXT:
-			if(seq_play < seq_last) seq_play ++;
-			while(seq_play < seq_last && !(seq_play->note & 0x80)) seq_play ++;
-			play_one(seq_play->note);
-			seq_ticks = seq_play->ticks;
+			p = next_on(seq_play < seq_last ? seq_play - seq_list + 1 : seq_last - seq_list);
+			if(seq_list + p < seq_last) {
+				seq_goto(p, seq_list[p].ticks);
+				play_one(seq_play->note);
+			} else {
+				seq_goto(p, seq_ticks);
+				bip(BIP_ALERT);
+			}
 			seq_metro = 0;
 			break;
 
@@ -218,10 +506,13 @@ void seq_cmd(enum seq_cmd cmd)
 			break;
 		
 		case SEQ_CMD_ONEKEY_ON:
-			while(seq_play < seq_last && !(seq_play->note & 0x80)) seq_play ++;
-			note_on(seq_play->note & 0x7f);
-			seq_ticks = seq_play->ticks;
-			if(seq_play < seq_last) seq_play ++;
+			p = next_on(seq_play - seq_list);
+			if(seq_list + p < seq_last) {
+				note_on(seq_list[p].note & 0x7f);
+				seq_goto(p + 1, seq_list[p].ticks);
+			} else {
+				seq_goto(p, seq_ticks);
+			}
 			break;
 		
 		case SEQ_CMD_ONEKEY_OFF:
@@ -229,44 +520,246 @@ void seq_cmd(enum seq_cmd cmd)
 			break;
 		
 	}
+
+	seq_changed = 1;
 }
 
 
-void seq_tick(void)
+/*
+ * Account for k ticks without events. When the main loop has set seq_ticks
+ * meanwhile, its value stands
+ */
+
+static void skip_ticks(uint16_t k)
 {
-	static uint8_t t = 0;
+	if(counting && seq_ticks == tick_base) seq_ticks += k;
+	rhythm_skip(k);
+}
 
-	if(t-- == 0) {
-		t = seq_tempo;
 
-		if(seq_metro) {
-			if((seq_ticks % 60) == 0) bip(5);
-			if((seq_ticks % (60*seq_measures)) == 0) bip(25);
-		}
+/*
+ * Start the notes held at the position seq_goto() moved to
+ */
 
-		if(seq_state != SEQ_STATE_IDLE) {
-			while(seq_ticks == seq_play->ticks) {
-				uint8_t state = seq_play->note & 0x80;
-				uint8_t note = seq_play->note & 0x7f;
-				(state ? note_on : note_off)(note);
-				seq_play ++;
-			}
+static void restore(void)
+{
+	uint8_t note;
 
-			if(seq_state == SEQ_STATE_PLAY) {
-				if(seq_play >= seq_last) {
-					bip(BIP_ALERT);
-					seq_state = SEQ_STATE_IDLE;
-				}
-			}
+	for(note=0; note<128; note++) {
+		if(seq_held[note >> 3] & (1 << (note & 7))) voice_on(note);
+	}
+}
+
+
+static void run_tick(void)
+{
+	if(seq_metro) {
+		if((seq_ticks % 60) == 0) bip(5);
+		if((seq_ticks % (60*seq_measures)) == 0) bip(25);
+	}
+
+	rhythm_tick();
+
+	if(seq_state != SEQ_STATE_IDLE) {
+		if(restore_at == seq_play) restore();
+		restore_at = NULL;
+		while(seq_play < seq_last && seq_ticks == seq_play->ticks) {
+			uint8_t state = seq_play->note & 0x80;
+			uint8_t note = seq_play->note & 0x7f;
+			(state ? voice_on : voice_off)(note);
+			seq_play ++;
 		}
-		
-		if(seq_state != SEQ_STATE_IDLE || seq_metro) { 
-			seq_ticks ++;
+
+		if(seq_state == SEQ_STATE_PLAY) {
+			if(seq_play >= seq_last) {
+				bip(BIP_ALERT);
+				seq_state = SEQ_STATE_IDLE;
+			}
 		}
 	}
+	
+	if(seq_state != SEQ_STATE_IDLE || seq_metro) { 
+		seq_ticks ++;
+	}
+}
+
+
+/*
+ * Find the next tick with an event, metronome click, rhythm step or note to
+ * record, and return the number of samples until it
+ */
+
+static uint16_t schedule(void)
+{
+	uint16_t d = 0xffff;		/* Empty ticks before the next event */
+	uint16_t t, max;
+
+	tick_len = (seq_tempo + 1) * (uint32_t)SRATE / TEMPO_SRATE;
+	tick_base = seq_ticks;
+	counting = seq_state != SEQ_STATE_IDLE || seq_metro;
+
+	if(seq_state == SEQ_STATE_REC) {
+		d = 0;
+	} else if(seq_state == SEQ_STATE_PLAY) {
+		d = seq_play < seq_last ? (uint16_t)(seq_play->ticks - seq_ticks) : 0;
+	}
+
+	if(seq_metro) {
+		t = seq_ticks % 60;
+		t = t ? 60 - t : 0;
+		if(t < d) d = t;
+	}
+
+	t = rhythm_wait();
+	if(t < d) d = t;
+
+	max = 0xffff / tick_len;
+	planned = d < max ? d + 1 : max;
+	return planned * tick_len;
+}
+
+
+/*
+ * Run the due sequencer tick, returns the number of samples until the next
+ * one to run
+ */
+
+uint16_t seq_tick(void)
+{
+	skip_ticks(planned - 1);
+	run_tick();
+	return schedule();
+}
+
+
+/*
+ * Called by the renderer when seq_changed is set, with the samples left
+ * until the planned tick. The ticks already passed, including one due right
+ * now, were empty and ran before the change; the next tick on the grid runs
+ * in full and plans again with the new state. Returns the samples until it
+ */
+
+uint16_t seq_resync(uint16_t wait)
+{
+	uint16_t e = planned * tick_len - wait;
+	uint16_t passed = e / tick_len;
+
+	seq_changed = 0;
+	skip_ticks(passed);
+	planned = 1;
+	tick_base = seq_ticks;
+
+	return (passed + 1) * tick_len - e;
 }
 
 
+#ifdef UNIT_TEST
+
+/*
+ * Plays from positions reached with the transport keys and checks that the
+ * notes held across them sound. The engine is replaced by a table of the
+ * notes voice_on() and voice_off() leave sounding
+ */
+
+#include <stdio.h>
+
+static uint8_t sounding[128];
+static int failed = 0;
+
+void voice_on(uint8_t note) { sounding[note & 0x7f] = 1; }
+void voice_off(uint8_t note) { sounding[note & 0x7f] = 0; }
+void note_on(uint8_t note) { (void)note; }
+void note_off(uint8_t note) { (void)note; }
+void all_off(void) { memset(sounding, 0, sizeof sounding); }
+void bip(uint8_t duration) { (void)duration; }
+void rhythm_tick(void) { }
+uint16_t rhythm_wait(void) { return 0xffff; }
+void rhythm_skip(uint16_t ticks) { (void)ticks; }
+
+
+/*
+ * Play from the current position through tick, running the sequencer sample
+ * by sample like render_block() does. Empty ticks are skipped, so tick must
+ * have an event
+ */
+
+static void play_to(uint16_t tick)
+{
+	static uint16_t wait = 1;
+	uint32_t i;
+
+	all_off();
+	seq_cmd(SEQ_CMD_PLAY);
+	for(i=0; i<1000000 && seq_ticks <= tick; i++) {
+		if(seq_changed) wait = seq_resync(wait);
+		if(--wait == 0) wait = seq_tick();
+	}
+	seq_cmd(SEQ_CMD_STOP);
+}
+
+
+static void expect(const char *what, uint8_t note, uint8_t state)
+{
+	if(sounding[note] != state) {
+		printf("%s: note %d %s\n", what, note, state ? "silent" : "sounding");
+		failed = 1;
+	}
+}
+
+
+int main(void)
+{
+	uint8_t i;
+
+	/* Note 20 is held from the start and note 21 from tick 207, under
+	 * 40 short notes 40..59 every 10 ticks from tick 10 */
+
+	seq_init();
+	seq_cmd(SEQ_CMD_CLEAR);
+	seq_append(0, 0x80 | 20);
+	for(i=0; i<40; i++) {
+		if(i == 20) seq_append(207, 0x80 | 21);
+		seq_append(10 + 10 * i, 0x80 | (40 + i % 20));
+		seq_append(15 + 10 * i, 40 + i % 20);
+	}
+	seq_append(500, 20);
+	seq_append(505, 21);
+
+	/* NEXT to the note at tick 240, 43 */
+
+	seq_cmd(SEQ_CMD_FIRST);
+	for(i=0; i<25; i++) seq_cmd(SEQ_CMD_NEXT);
+	play_to(240);
+	expect("next", 20, 1);
+	expect("next", 21, 1);
+	expect("next", 43, 1);
+	expect("next", 42, 0);
+
+	/* PREV from the last note, at tick 400, to the one at tick 350, 54 */
+
+	seq_cmd(SEQ_CMD_LAST);
+	for(i=0; i<5; i++) seq_cmd(SEQ_CMD_PREV);
+	play_to(350);
+	expect("prev", 20, 1);
+	expect("prev", 21, 1);
+	expect("prev", 54, 1);
+	expect("prev", 53, 0);
+
+	/* Back to the top, only the first note */
+
+	seq_cmd(SEQ_CMD_FIRST);
+	play_to(0);
+	expect("first", 20, 1);
+	expect("first", 21, 0);
+	expect("first", 40, 0);
+
+	printf("%s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
+
+#endif
+
+
 /*
  * End
  */
@@ -20,9 +20,15 @@ enum seq_cmd {
 	SEQ_CMD_ONEKEY_OFF,
 };
 
+extern volatile uint8_t seq_changed;
+
 void seq_init(void);
 void seq_note(uint8_t note, uint8_t state);
 void seq_cmd(enum seq_cmd cmd);
-void seq_tick(void);
+uint16_t seq_tick(void);
+uint16_t seq_resync(uint16_t wait);
+uint8_t seq_playing(void);
+uint8_t seq_append(uint16_t ticks, uint8_t note);
+void seq_seek(uint16_t ticks);
 
 #endif
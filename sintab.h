@@ -1,7 +0,0 @@
-#ifndef sintab_h
-#define sintab_h
-
-#define SINTAB_LEN 256
-extern int8_t sintab[SINTAB_LEN];
-
-#endif
@@ -0,0 +1,101 @@
+#ifndef tables_h
+#define tables_h
+
+/*
+ * Sine and note step tables in flash, generated by gentab for the sample
+ * rate, sine table length and bit depth set in the Makefile.
+ *
+ * With SINTAB_QUARTER only the first quarter wave, 0 to 90 degrees inclusive,
+ * is stored and the rest follows from symmetry. Use sin_get() for the signed
+ * table value, or sin_mag() for its magnitude.
+ */
+
+#ifndef SINTAB_ORDER
+#define SINTAB_ORDER 8		/* Sine table length is 2^SINTAB_ORDER */
+#endif
+
+#ifndef SINTAB_BITS
+#define SINTAB_BITS 8		/* Bits per sine table entry, 8 to 16 */
+#endif
+
+#ifndef PHASE_BITS
+#define PHASE_BITS 24		/* Phase accumulator bits, 16, 24 or 32 */
+#endif
+
+#define SINTAB_LEN (1 << SINTAB_ORDER)
+#define SIN_SHIFT (PHASE_BITS - SINTAB_ORDER)	/* Phase to table index */
+#define SIN_SCALE (SINTAB_BITS - 8)	/* Table value to 8 bit */
+
+#ifdef SINTAB_QUARTER
+#define SINTAB_SIZE (SINTAB_LEN / 4 + 1)
+#else
+#define SINTAB_SIZE SINTAB_LEN
+#endif
+
+#if SINTAB_ORDER > 8
+typedef uint16_t sin_idx_t;
+#else
+typedef uint8_t sin_idx_t;
+#endif
+
+#if SINTAB_BITS > 8
+typedef int16_t sin_t;
+typedef uint16_t sin_mag_t;
+#define sin_read(p) ((sin_t)pgm_read_word(p))
+#else
+typedef int8_t sin_t;
+typedef uint8_t sin_mag_t;
+#define sin_read(p) ((sin_t)pgm_read_byte(p))
+#endif
+
+/*
+ * Oscillator phase. The table index is in the top bits, so with 24 bit phases
+ * and the 256 entry table it is the high byte and costs nothing to extract on
+ * the AVR. Above 16 bits the host uses plain 32 bit integers
+ */
+
+#if PHASE_BITS == 16
+typedef uint16_t phase_t;
+#elif PHASE_BITS == 24 && defined(__AVR__)
+typedef __uint24 phase_t;
+#else
+typedef uint32_t phase_t;
+#endif
+
+#define NUM_NOTES 128
+#define F_NOTE0 43.653		/* Lowest note we can play is F1 at 43.653 Hz */
+
+extern const sin_t sintab[SINTAB_SIZE] PROGMEM;
+extern const uint32_t notetab[NUM_NOTES] PROGMEM;	/* Phase step of each note */
+extern const uint16_t semitab[12] PROGMEM;		/* 2^(k/12), Q4.12 */
+
+#ifdef SINTAB_QUARTER
+
+static inline sin_mag_t sin_mag(sin_idx_t i)
+{
+	i &= SINTAB_LEN/2 - 1;
+	if(i > SINTAB_LEN/4) i = SINTAB_LEN/2 - i;
+	return sin_read(&sintab[i]);
+}
+
+static inline sin_t sin_get(sin_idx_t i)
+{
+	sin_t v = sin_mag(i);
+	return (i & (SINTAB_LEN/2)) ? -v : v;
+}
+
+#else
+
+static inline sin_mag_t sin_mag(sin_idx_t i)
+{
+	return sin_read(&sintab[i & (SINTAB_LEN/2 - 1)]);
+}
+
+static inline sin_t sin_get(sin_idx_t i)
+{
+	return sin_read(&sintab[i & (SINTAB_LEN - 1)]);
+}
+
+#endif
+
+#endif